@@ -10,9 +10,15 @@
 
 //where nv is the size of the graph, and print is 1 if graph and min
 //distances are to be printed out, 0 otherwise
+
+//compile with gcc -fopenmp -I../common -o dijkstra dijkstra.c
 #include <stdlib.h>
 #include <omp.h>
 #include <stdio.h>
+#include "philox.h"
+
+#define GRAPHSEED 1 //key of the random graph
+
 //global variables, shared by all threads by default; could placed them
 //above the "parallel" pragma in dowork()
 
@@ -47,14 +53,15 @@ void init(int ac, char **av)
   ohd = malloc(nv*nv*sizeof(int));
   mind = malloc(nv*sizeof(int));
   notdone = malloc(nv*sizeof(int));
-  //random graph
-
-
+  //random graph: edge (i,j) gets element j of Philox stream i
+  //(../common/philox.h), so the rows can be filled in parallel and the
+  //graph is the same for any number of threads
+#pragma omp parallel for private(j) schedule(dynamic)
   for (i = 0; i < nv; i++) 
     for (j = i; j < nv; j++) {
       if (j == i) ohd[i*nv+i] = 0;
       else {
-	ohd[nv*i+j] = rand() % 200;
+	ohd[nv*i+j] = philox_below(philox4x32(GRAPHSEED, i, j).v[0], 200);
 	ohd[nv*j+i] = ohd[nv*i+j];
       }
 
@@ -1,6 +1,6 @@
 //compile with -D, e.g
 //
-// gcc -fopenmp -o manbrot mandlebrot.c -DDYNAMIC
+// gcc -fopenmp -I../common -o manbrot mandlebrot.c -DDYNAMIC
 //
 //to get the version that uses dynamic scheduling
 
@@ -28,19 +28,14 @@ void findmyrange(int n, int nth, int me, int *myrange)
   else myrange[1] = n - 1;
 }
 
-#include <stdlib.h>
-#include <stdio.h>
-//returns a random permutation of 0..n-1
+#include "philox.h"
+//returns a random permutation of 0..n-1; it comes from Philox
+//(../common/philox.h), the same one mpi_rc.c uses, so no rand() state
+#define PERMSEED 1
 int *rpermute(int n) {
-  int *a = (int *) (int *) malloc(n*sizeof(int));
+  int *a = (int *) malloc(n*sizeof(int));
   int k;
-  for (k=0; k < n; k++) a[k] = k;
-  for (k=n-1; k > 0; k--) {
-    int j = rand() % (k+1);
-    int temp = a[j];
-    a[j] = a[k];
-    a[k] = temp;
-  }
+  for (k=0; k < n; k++) a[k] = (int) philox_permute(PERMSEED, n, k);
   return a;
 }
 #endif
@@ -1,9 +1,12 @@
 //Dijkstra
 
-//
+//compile with mpicc -I../common -o mpi_dijkstra mpi_dijkstra.c
 #include <stdio.h>
 #include <mpi.h>
 #include <stdlib.h>
+#include "philox.h"
+
+#define GRAPHSEED 9999 //key of the random graph
 #define MYMIN_MSG 0
 #define OVRLMIN_MSG 1
 #define COLLECT_MSG 2
@@ -46,15 +49,15 @@ void init(int ac, char **av)
   ohd = malloc(nv*nv*sizeof(int));
   mind = malloc(nv*sizeof(int));
   notdone = malloc(nv*sizeof(int));
-  //random graph
-  //note that this will be generated at all nodes; could generate just
-  //at node 0 and then send to others, but faster this way
-  srand(9999);
+  //random graph: edge (i,j) gets element j of Philox stream i
+  //(../common/philox.h).  Every node makes the whole graph, as before;
+  //it is the same graph on every node because each weight depends on
+  //nothing but i and j
   for (i=0; i < nv; i++)
     for (j=i; j < nv; j++) {
       if (j==i) ohd[i*nv+i] = 0;
       else {
-        ohd[nv*i+j] = rand() % 20;
+        ohd[nv*i+j] = philox_below(philox4x32(GRAPHSEED, i, j).v[0], 20);
 	ohd[nv*j+i] = ohd[nv*i+j]; 
       }
     }
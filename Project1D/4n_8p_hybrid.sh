@@ -0,0 +1,28 @@
+#!/bin/bash
+#PBS -l nodes=4:ppn=8
+#PBS -l walltime=01:00:00
+#PBS -l pmem=2000mb
+#PBS -N 4n_8p_hybrid
+#PBS -q parallel
+#PBS -j oe
+
+cd $PBS_O_WORKDIR
+
+# one rank per node, one OpenMP thread per core
+export OMP_NUM_THREADS=8
+export OMP_PROC_BIND=close
+export OMP_PLACES=cores
+
+mpiexec -n 4 --map-by node:PE=8 ./mpi_rc -v -s dynamic 10240
+
+for s in static dynamic guided;
+
+do
+	for i in `seq 1 10`;
+
+	do
+		mpiexec -n 4 --map-by node:PE=8 ./mpi_rc -s $s 10240
+	done
+done
+
+wait
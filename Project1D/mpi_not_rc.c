@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <stdio.h>
+#include "philox.h"
 
 float timediff(struct timespec t1, struct timespec t2)
 {  if (t1.tv_nsec > t2.tv_nsec) {
@@ -30,18 +31,13 @@ void findmyrange(int n, int nth, int me, int *myrange)
 }
 
 
-//returns a random permutation of n from start..end  
+//returns a random permutation of n from start..end; it comes from
+//Philox (../common/philox.h) like the one in mpi_rc.c, so no rand() state
+#define PERMSEED 1
 int *rpermute(int n, int start) {
-  int *a = (int *) (int *) malloc(n*sizeof(int));
+  int *a = (int *) malloc(n*sizeof(int));
   int k;
-  int i = start;
-  for (k=0; k < n; k++) a[k] = i++;
-  for (k=n-1; k > 0; k--) {
-    int j = rand() % (k+1);
-    int temp = a[j];
-    a[j] = a[k];
-    a[k] = temp;
-  }
+  for (k=0; k < n; k++) a[k] = start + (int) philox_permute(PERMSEED, n, k);
   return a;
 }
 
@@ -1,15 +1,70 @@
-//compile with -D, e.g
+//hybrid MPI+OpenMP Mandelbrot: MPI splits the columns across ranks, and
+//inside each rank OpenMP threads work through tiles of columns.  compile
+//with (without -fopenmp you get one thread per rank)
 //
-// gcc -fopenmp -o manbrot mandlebrot.c -DDYNAMIC
+// mpicc -fopenmp -O3 -I../common -o mpi_rc mpi_rc.c
 //
-//to get the version that uses dynamic scheduling
+//and run with e.g.
+//
+// export OMP_NUM_THREADS=8 OMP_PROC_BIND=close OMP_PLACES=cores
+// mpiexec -n 4 --map-by node:PE=8 ./mpi_rc [-s dynamic,1] [-p random]
+//   [-c 4] [-v] [-o image.pgm] [-t pgm|raw]
+//   [-x cx] [-y cy] [-w span] [-a aspect] [-z] 10240
+//
+//-s picks the OpenMP schedule (static, dynamic or guided, optionally with
+//a chunk size) that used to be baked in with -DSTATIC/-DDYNAMIC/-DGUIDED,
+//-p picks the column distribution across ranks (random, as in the old rc
+//binaries, block, as in the old not_rc ones, or cost: contiguous blocks
+//of equal predicted work, see costpartition), -c is the number of
+//columns per tile, and -v prints where every rank and thread runs.  Only
+//the master thread calls MPI, so MPI_THREAD_FUNNELED is all we ask for.
+//
+//-P float|double|auto picks the precision of the escape kernel.  auto (the
+//default) uses float while a pixel is still FLOATULPS float ulps wide at
+//the coordinates in view, which holds at our usual sizes and runs twice
+//as many SIMD lanes.  -V computes both and reports how many pixels differ
+//(not with -z, whose perturbation kernel only comes in double).
+//
+//The view is centred on cx+cy*i, span wide, and width/height = aspect
+//(defaults 0, 0, 4, 1 give the usual [-2,2]^2); nptsside is the width in
+//pixels.  -z turns on deep zoom: one reference orbit through the centre
+//is computed in long double (__float128 with -DQUAD, link -lquadmath) and
+//every pixel only iterates its offset from it in double, so spans far
+//below 1e-13 still resolve.
+//
+//-o records the escape iteration of every pixel as uint16.  With -t pgm
+//(the default) all ranks write their columns into one 16-bit binary PGM
+//with collective MPI-IO; with -t raw every rank writes its own tile file
+//image.<rank>.  Output goes out in bands of rows from two alternating
+//buffers, so the next band is computed while the previous one is written.
+//Without -o the whole image is a single band.
 
 
+#define _GNU_SOURCE
 #include <mpi.h>
-#include <complex.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 #include <time.h>
 #include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "philox.h"
+
+#ifdef QUAD
+#include <quadmath.h>
+typedef __float128 hp_t;
+#define strtohp(s) strtoflt128(s, NULL)
+#else
+typedef long double hp_t;
+#define strtohp(s) strtold(s, NULL)
+#endif
 
 float timediff(struct timespec t1, struct timespec t2)
 {  if (t1.tv_nsec > t2.tv_nsec) {
@@ -30,171 +85,589 @@ void findmyrange(int n, int nth, int me, int *myrange)
 }
 
 
-//returns a random permutation of n from start..end  
-int *rpermute(int n, int start) {
-  int *a = (int *) (int *) malloc(n*sizeof(int));
-  int k;
-  int i = start;
-  for (k=0; k < n; k++) a[k] = i++;
-  for (k=n-1; k > 0; k--) {
-    int j = rand() % (k+1);
-    int temp = a[j];
-    a[j] = a[k];
-    a[k] = temp;
-  }
-  return a;
-}
+//-p random deals the columns out by a random permutation of 0..nptsside-1.
+//It comes from Philox (../common/philox.h), which gives element i of the
+//permutation directly, so every rank works out its own columns: there is
+//no permutation on rank 0 and no scatter, and the columns a rank gets do
+//not depend on anything but the number of ranks
+#define PERMSEED 1
 
 
 #define MAXITERS 1000
+#define BANDROWS 64     //rows per output band
+#define LANES 8         //pixels iterated side by side in double
+#define LANES32 16      //and in float
+#define FLOATULPS 512   //-P auto: smallest pixel, in float ulps, for float
+#define LINELEN 1024    //length of one rank's line in the -v report
+#define COSTSTRIDE 16   //-p cost samples every COSTSTRIDE-th pixel each way
+#define COSTITERS 100   //with this many iterations at most
+
+#define PART_RANDOM 0
+#define PART_BLOCK 1
+#define PART_COST 2
+
+#define PREC_FLOAT 0
+#define PREC_DOUBLE 1
 
 //globals
 int count = 0, tot_count;
-int nptsside, mpi_chunksize;
+int nptsside, nptsy, mpi_chunksize;
 int print_node;
-float side2;
-float side4;
+hp_t cx = 0, cy = 0;    //view centre
+double span = 4;        //view width
+double aspect = 1;      //width / height
+double pixsize;         //span / nptsside
+int deepzoom = 0;
+double *refr, *refi;    //reference orbit through the centre
+int reflen;             //last valid index of the reference orbit
 int nnodes;
 int my_rank;
 int myrange[2];
+int provided;           //thread level MPI gave us
+int partition = PART_RANDOM;    //-p: how columns are spread over ranks
+int tilecols = 4;       //-c: columns per OpenMP tile
+int verbose = 0;        //-v: report placement of ranks and threads
+int kernel = -1;        //-P: PREC_FLOAT or PREC_DOUBLE, -1 is auto
+int verify = 0;         //-V: compare the float and double kernels
+char *outname = NULL;   //-o: where the escape iterations go
+int outraw = 0;         //-t raw: one tile file per rank instead of a PGM
+
+//escape kernels: for NL pixels of one column at cr + ci[l]*i, the number
+//of iterations before each escapes, maxit if it never does.  Everything
+//stays in precision T, and the lane loop has no early exit so it
+//vectorises; lanes that escaped keep iterating harmlessly until all have.
+#define DEFINE_ESCAPE(name, T, NL)                                      \
+void name(T cr, const T *ci, int *its, int maxit)                       \
+{                                                                       \
+  T zr[NL], zi[NL];                                                     \
+  int l, iters, active = NL;                                            \
+  for (l=0; l < NL; l++) {                                              \
+    zr[l] = cr;                                                         \
+    zi[l] = ci[l];                                                      \
+    its[l] = maxit;                                                     \
+  }                                                                     \
+  for (iters = 0; iters < maxit && active; iters++) {                   \
+    active = 0;                                                         \
+    for (l=0; l < NL; l++) {                                            \
+      T t = zr[l]*zr[l] - zi[l]*zi[l] + cr;                             \
+      T u = 2*zr[l]*zi[l] + ci[l];                                      \
+      int live = (its[l] == maxit);                                     \
+      int esc = live & (t*t + u*u > 4);                                 \
+      its[l] = esc ? iters : its[l];                                    \
+      zr[l] = t;                                                        \
+      zi[l] = u;                                                        \
+      active += live & !esc;                                            \
+    }                                                                   \
+  }                                                                     \
+}
 
-int inset(double complex c) {
-  int iters;
-  float rl,im;
-  double complex z = c;
-  for (iters = 0; iters < MAXITERS; iters++) {
-    z = z*z +c;
-    rl = creal(z);
-    im = cimag(z);
-    if (rl*rl + im*im > 4) return 0;
+DEFINE_ESCAPE(escape32, float, LANES32)
+DEFINE_ESCAPE(escape64, double, LANES)
 
+//Z_0 = 0, Z_{n+1} = Z_n^2 + C for the view centre, iterated in hp_t until
+//it escapes or runs out of iterations, then rounded to double.  Only the
+//rounded orbit is needed afterwards: the pixels carry the small part.
+void referenceorbit()
+{
+  hp_t zr = 0, zi = 0, t;
+  int n;
+  refr = malloc((MAXITERS+2)*sizeof(double));
+  refi = malloc((MAXITERS+2)*sizeof(double));
+  refr[0] = refi[0] = 0;
+  for (n = 1; n <= MAXITERS+1; n++) {
+    t = zr*zr - zi*zi + cx;
+    zi = 2*zr*zi + cy;
+    zr = t;
+    refr[n] = (double) zr;
+    refi[n] = (double) zi;
+    if (refr[n]*refr[n] + refi[n]*refi[n] > 4) break;
   }
-  return 1;
+  reflen = (n > MAXITERS+1) ? MAXITERS+1 : n;
 }
 
+//perturbation version of escapeiters for LANES pixels at offsets dc from
+//the centre: d_{n+1} = (2 Z_m + d_n) d_n + dc, z = Z_{m+1} + d_{n+1}.
+//Whenever |z| < |d| (the pixel has drifted away from the reference, which
+//would lose precision) or the reference runs out, we rebase: d = z and
+//start over at m = 0.  The lane loop has no early exit so the compiler
+//can vectorise it; lanes that already escaped just stop changing.
+void deepiters(const double *dcr, const double *dci, int *its, int maxit)
+{
+  double dr[LANES], di[LANES];
+  int m[LANES], j, l, active = LANES;
+
+  for (l=0; l < LANES; l++) {
+    dr[l] = di[l] = 0;
+    m[l] = 0;
+    its[l] = maxit;
+  }
+
+  //same count as escape32/64: z_1 = c is never tested, z_2 escaping is 0
+  for (j = 1; j <= maxit+1 && active; j++) {
+    active = 0;
+    for (l=0; l < LANES; l++) {
+      double tr = 2*refr[m[l]] + dr[l];
+      double ti = 2*refi[m[l]] + di[l];
+      double nr = tr*dr[l] - ti*di[l] + dcr[l];
+      double ni = tr*di[l] + ti*dr[l] + dci[l];
+      int m1 = m[l] + 1;
+      double zr = refr[m1] + nr;
+      double zi = refi[m1] + ni;
+      double z2 = zr*zr + zi*zi;
+      int live = (its[l] == maxit);
+      int esc = live & (j >= 2) & (z2 > 4);
+      int rebase = (z2 < nr*nr + ni*ni) | (m1 == reflen);
+
+      its[l] = esc ? j-2 : its[l];
+      dr[l] = live ? (rebase ? zr : nr) : dr[l];
+      di[l] = live ? (rebase ? zi : ni) : di[l];
+      m[l]  = live ? (rebase ? 0 : m1) : m[l];
+      active += live & !esc;
+    }
+  }
+}
+
+//iteration counts of npix pixels of column x, starting at row y0 and
+//ystride rows apart, with the given kernel (deep zoom has its own)
+void pixels(int x, int y0, int ystride, int npix, int *its, int maxit,
+            int prec)
+{
+  int k, l, tmp[LANES32];
+  double dx = (x - nptsside/2.0) * pixsize;
+
+  for (k = 0; k < npix; k += (prec == PREC_FLOAT && !deepzoom) ? LANES32 : LANES) {
+    if (deepzoom) {
+      double dcr[LANES], dci[LANES];
+      for (l=0; l < LANES; l++) {
+        dcr[l] = dx;
+        dci[l] = (y0 + (k+l)*ystride - nptsy/2.0) * pixsize;
+      }
+      deepiters(dcr, dci, tmp, maxit);
+      for (l=0; l < LANES && k+l < npix; l++) its[k+l] = tmp[l];
+    } else if (prec == PREC_FLOAT) {
+      float ci[LANES32];
+      for (l=0; l < LANES32; l++)
+        ci[l] = (float) ((double) cy + (y0 + (k+l)*ystride - nptsy/2.0) * pixsize);
+      escape32((float) ((double) cx + dx), ci, tmp, maxit);
+      for (l=0; l < LANES32 && k+l < npix; l++) its[k+l] = tmp[l];
+    } else {
+      double ci[LANES];
+      for (l=0; l < LANES; l++)
+        ci[l] = (double) cy + (y0 + (k+l)*ystride - nptsy/2.0) * pixsize;
+      escape64((double) cx + dx, ci, tmp, maxit);
+      for (l=0; l < LANES && k+l < npix; l++) its[k+l] = tmp[l];
+    }
+  }
+}
+
+//float is good enough while a pixel spans FLOATULPS float ulps of the
+//largest coordinate in view
+int choosekernel()
+{
+  double big = fabs((double) cx) + span/2;
+  double bigy = fabs((double) cy) + span/(2*aspect);
+  if (bigy > big) big = bigy;
+  if (big < 1) big = 1;
+  return pixsize >= FLOATULPS * FLT_EPSILON * big ? PREC_FLOAT : PREC_DOUBLE;
+}
+
+//cheap preview of the work: every COSTSTRIDE-th pixel each way, iterated
+//at most COSTITERS times.  Pixels still inside by then will most likely
+//run all MAXITERS, so that is what they are charged.  Every rank does the
+//same small computation, which is cheaper than talking about it.
+void estimatecost(double *colcost)
+{
+  int nsx = (nptsside + COSTSTRIDE-1) / COSTSTRIDE;
+  double *samp = malloc(nsx*sizeof(double));
+  int sx, x;
+
+  #pragma omp parallel for schedule(dynamic)
+  for (sx=0; sx < nsx; sx++) {
+    int sxx = sx*COSTSTRIDE + COSTSTRIDE/2 < nptsside ?
+              sx*COSTSTRIDE + COSTSTRIDE/2 : nptsside-1;
+    int nsy = (nptsy - COSTSTRIDE/2 + COSTSTRIDE-1) / COSTSTRIDE;
+    int *its = malloc((nsy+1)*sizeof(int));
+    int k;
+    double sum = 0;
+
+    pixels(sxx, COSTSTRIDE/2, COSTSTRIDE, nsy, its, COSTITERS, kernel);
+    for (k=0; k < nsy; k++)
+      sum += (its[k] == COSTITERS) ? MAXITERS : its[k] + 1;
+    samp[sx] = sum;
+    free(its);
+  }
+
+  for (x=0; x < nptsside; x++) colcost[x] = samp[x/COSTSTRIDE];
+  free(samp);
+}
+
+//contiguous ranges of columns carrying equal shares of the predicted cost:
+//rank r starts at the first column where the running total reaches r/nnodes
+//of the whole.  Keeps the locality of blocks, balances like random columns.
+void costpartition(int *counts, int *displs)
+{
+  double *colcost = malloc(nptsside*sizeof(double));
+  double total = 0, run = 0, worst = 0;
+  int x, r = 1;
+
+  estimatecost(colcost);
+  for (x=0; x < nptsside; x++) total += colcost[x];
+
+  displs[0] = 0;
+  for (x=0; x < nptsside && r < nnodes; x++) {
+    while (r < nnodes && run >= total * r / nnodes)
+      displs[r++] = x;
+    run += colcost[x];
+  }
+  while (r < nnodes)
+    displs[r++] = x;
+  for (r=0; r < nnodes; r++)
+    counts[r] = (r < nnodes-1 ? displs[r+1] : nptsside) - displs[r];
+
+  if (verbose && my_rank == 0) {
+    for (r=0, x=0; r < nnodes; r++) {
+      double share = 0;
+      for (; x < displs[r] + counts[r]; x++) share += colcost[x];
+      if (share > worst) worst = share;
+    }
+    printf("cost partition: predicted max/mean load %f\n",
+           total > 0 ? worst * nnodes / total : 1.0);
+  }
+  free(colcost);
+}
 
-#include <mpi.h>
-#include <complex.h>
-#include <stdlib.h>
-#include <time.h>
-#include <stdio.h>
 
 int *scram;
+int *slot;      //slot[i] = position of column scram[i] in sorted order
+
+//the output file is opened with a view that shows each rank only its own
+//columns, row after row, so band offsets are just y0*mpi_chunksize
+MPI_File openoutput()
+{
+  MPI_File fh;
+  MPI_Datatype rowtype, filetype;
+  MPI_Offset hdrlen;
+  char fname[1024], hdr[64];
+  int *cols = malloc((mpi_chunksize+1)*sizeof(int));
+  int i, x;
+
+  //owned columns in increasing order, and where each one of scram lands
+  int *pos = malloc(nptsside*sizeof(int));
+  for (x=0; x < nptsside; x++) pos[x] = -1;
+  for (i=0; i < mpi_chunksize; i++) pos[scram[i]] = 0;
+  for (x=0, i=0; x < nptsside; x++)
+    if (pos[x] == 0) { cols[i] = x; pos[x] = i++; }
+  for (i=0; i < mpi_chunksize; i++) slot[i] = pos[scram[i]];
+  free(pos);
+
+  if (outraw) {
+    //tile header: rows, columns, then the column indices
+    int tilehdr[2] = { nptsy, mpi_chunksize };
+    snprintf(fname, sizeof(fname), "%s.%d", outname, my_rank);
+    MPI_File_open(MPI_COMM_SELF, fname, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                  MPI_INFO_NULL, &fh);
+    MPI_File_set_size(fh, 0);
+    MPI_File_write_at(fh, 0, tilehdr, 2, MPI_INT, MPI_STATUS_IGNORE);
+    MPI_File_write_at(fh, 2*sizeof(int), cols, mpi_chunksize, MPI_INT,
+                      MPI_STATUS_IGNORE);
+    hdrlen = (2 + mpi_chunksize) * sizeof(int);
+    MPI_File_set_view(fh, hdrlen, MPI_UINT16_T, MPI_UINT16_T, "native",
+                      MPI_INFO_NULL);
+  } else {
+    hdrlen = snprintf(hdr, sizeof(hdr), "P5\n%d %d\n%d\n",
+                      nptsside, nptsy, MAXITERS);
+    MPI_File_open(MPI_COMM_WORLD, outname, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                  MPI_INFO_NULL, &fh);
+    MPI_File_set_size(fh, 0);
+    if (my_rank == 0)
+      MPI_File_write_at(fh, 0, hdr, hdrlen, MPI_CHAR, MPI_STATUS_IGNORE);
+
+    MPI_Type_create_indexed_block(mpi_chunksize, 1, cols, MPI_UINT16_T,
+                                  &rowtype);
+    MPI_Type_create_resized(rowtype, 0, nptsside*sizeof(uint16_t), &filetype);
+    MPI_Type_commit(&filetype);
+    MPI_File_set_view(fh, hdrlen, MPI_UINT16_T, filetype, "native",
+                      MPI_INFO_NULL);
+    MPI_Type_free(&rowtype);
+    MPI_Type_free(&filetype);
+  }
+
+  free(cols);
+  return fh;
+}
+
+#ifdef _OPENMP
+//-s static|dynamic|guided[,chunk] for the schedule(runtime) tile loop
+void setschedule(const char *arg)
+{
+  omp_sched_t kind = omp_sched_dynamic;
+  const char *comma = strchr(arg, ',');
+  if (strncmp(arg, "static", 6) == 0) kind = omp_sched_static;
+  else if (strncmp(arg, "guided", 6) == 0) kind = omp_sched_guided;
+  omp_set_schedule(kind, comma ? atoi(comma+1) : 0);
+}
+#endif
+
+//one line per rank with its host and the cpu (and OpenMP place) of every
+//thread, gathered so rank 0 can print them in order
+void reportaffinity()
+{
+  char line[LINELEN], host[256];
+  char *all = NULL;
+  int len, r;
+
+  gethostname(host, sizeof(host));
+  len = snprintf(line, LINELEN, "rank %d on %s, thread level %d:",
+                 my_rank, host, provided);
+#ifdef _OPENMP
+  int nth = omp_get_max_threads(), t;
+  int *cpu = malloc(nth*sizeof(int));
+  int *place = malloc(nth*sizeof(int));
+  #pragma omp parallel num_threads(nth)
+  {
+    cpu[omp_get_thread_num()] = sched_getcpu();
+    place[omp_get_thread_num()] = omp_get_place_num();
+  }
+  for (t=0; t < nth && len < LINELEN; t++)
+    len += snprintf(line+len, LINELEN-len, " %d@cpu%d/place%d",
+                    t, cpu[t], place[t]);
+  free(cpu);
+  free(place);
+#else
+  snprintf(line+len, LINELEN-len, " 0@cpu%d", sched_getcpu());
+#endif
+
+  if (my_rank == 0) all = malloc(nnodes*LINELEN);
+  MPI_Gather(line, LINELEN, MPI_CHAR, all, LINELEN, MPI_CHAR, 0,
+             MPI_COMM_WORLD);
+  if (my_rank == 0) {
+    for (r=0; r < nnodes; r++) printf("%s\n", all + r*LINELEN);
+    free(all);
+  }
+}
 
 void dowork()
 {
+    int t, ntiles, y0, nrows, bandrows, b = 0;
+    long ndiff = 0, nflip = 0, diffs[2] = { 0, 0 };
+    uint16_t *band[2] = { NULL, NULL };
+    MPI_Request req[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+    MPI_File fh;
+
+    if (outname) {
+      slot = malloc((mpi_chunksize+1)*sizeof(int));
+      band[0] = malloc((BANDROWS*mpi_chunksize+1)*sizeof(uint16_t));
+      band[1] = malloc((BANDROWS*mpi_chunksize+1)*sizeof(uint16_t));
+      fh = openoutput();
+    }
 
-  int mi;
-  // if (my_rank == print_node) {
-    
-  //   // #ifdef RC
-  //   // #pragma omp parallel 
-  //   // {
-  //   //   #pragma omp master 
-  //   //   { printf("Using %d threads\n", omp_get_num_threads()); }
-  //   // }
-  //   // #endif
-
-  //     printf("My rank is %d has %d:", my_rank, mpi_chunksize);
-  //     if (mpi_chunksize < 20) 
-  //       for (mi = 0; mi < mpi_chunksize; mi++) printf("%d ", scram[mi]);
-  //     printf("\n");
-  // }
-
-    int x,y; float xv, yv;
-    int i;
-    double complex z;
-
-  // #ifdef RC
-  // #pragma omp parallel for reduction(+:count) private(x,y,xv,yv,i,z)
-  // #else
-  
-    //#pragma omp single
-    //{ printf("Using %d threads\n", omp_get_num_threads()); }
-
-    #ifdef STATIC
-    #pragma omp parallel for reduction(+:count) schedule(static) private(x,y,xv,yv,i,z) 
-    #elif defined DYNAMIC
-    #pragma omp parallel for reduction(+:count) schedule(dynamic) private(x,y,xv,yv,i,z) 
-    #elif defined GUIDED
-    #pragma omp parallel for reduction(+:count) schedule(guided) private(x,y,xv,yv,i,z) 
-    #endif
-
-  // #endif
-
-    for (i=0; i < mpi_chunksize; i++) {
-      x = scram[i];
-
-       for (y=0; y < nptsside; y++) {
-         xv = (x - side2) / side4;
-	 yv = (y - side2) / side4;
-	 z = xv + yv*I;
-	 if (inset(z)) {
-	   count++;
-	 }
-       }
+    //bands only exist to overlap the writes; with no output it is one band
+    bandrows = outname ? BANDROWS : nptsy;
+
+    for (y0 = 0; y0 < nptsy; y0 += bandrows) {
+      uint16_t *buf = band[b];
+      nrows = (nptsy - y0 < bandrows) ? nptsy - y0 : bandrows;
+
+      //the write from two bands ago must be done before we reuse its buffer
+      MPI_Wait(&req[b], MPI_STATUS_IGNORE);
+
+      //a tile is tilecols columns by the band; -s decides who gets which
+      ntiles = (mpi_chunksize + tilecols - 1) / tilecols;
+      #pragma omp parallel reduction(+:count,ndiff,nflip)
+      {
+        int *ci = malloc(nrows*sizeof(int));
+        int *ci32 = verify ? malloc(nrows*sizeof(int)) : NULL;
+
+        #pragma omp for schedule(runtime)
+        for (t=0; t < ntiles; t++) {
+          int i, y;
+          int iend = (t+1)*tilecols < mpi_chunksize ? (t+1)*tilecols : mpi_chunksize;
+
+          for (i=t*tilecols; i < iend; i++) {
+            pixels(scram[i], y0, 1, nrows, ci, MAXITERS, kernel);
+            if (verify) {
+              pixels(scram[i], y0, 1, nrows, ci32, MAXITERS, PREC_FLOAT);
+              for (y=0; y < nrows; y++) {
+                ndiff += (ci[y] != ci32[y]);
+                nflip += ((ci[y] == MAXITERS) != (ci32[y] == MAXITERS));
+              }
+            }
+
+            for (y=0; y < nrows; y++) {
+	      if (ci[y] == MAXITERS) {
+	        count++;
+	      }
+	      if (buf) {
+	        //PGM wants big-endian samples, raw tiles stay native
+	        buf[y*mpi_chunksize + slot[i]] = outraw ? ci[y] : htons(ci[y]);
+	      }
+            }
+          }
+        }
+        free(ci);
+        free(ci32);
+      }
+
+      if (buf) {
+        if (outraw)
+          MPI_File_iwrite_at(fh, (MPI_Offset) y0*mpi_chunksize, buf,
+                             nrows*mpi_chunksize, MPI_UINT16_T, &req[b]);
+        else
+          MPI_File_iwrite_at_all(fh, (MPI_Offset) y0*mpi_chunksize, buf,
+                                 nrows*mpi_chunksize, MPI_UINT16_T, &req[b]);
+        b ^= 1;
+      }
+    }
+
+    if (outname) {
+      MPI_Waitall(2, req, MPI_STATUSES_IGNORE);
+      MPI_File_close(&fh);
+      free(band[0]);
+      free(band[1]);
+      free(slot);
     }
-  
 
   MPI_Reduce(&count, &tot_count, 1, MPI_INT, MPI_SUM, print_node, MPI_COMM_WORLD);
+  if (verify) {
+    long mine[2] = { ndiff, nflip };
+    MPI_Reduce(mine, diffs, 2, MPI_LONG, MPI_SUM, print_node, MPI_COMM_WORLD);
+    if (my_rank == print_node)
+      printf("float vs double: %ld of %ld pixels differ, %ld of them in/out\n",
+             diffs[0], (long) nptsside*nptsy, diffs[1]);
+  }
 }
 
 int main(int argc, char **argv)
 {
-  nptsside = atoi(argv[1]);
-  // print_node = atoi(argv[2]);
-  side2 = nptsside / 2.0;
-  side4 = nptsside / 4.0;
-
-
-  int provided, claimed;
-  MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided );
-  MPI_Query_thread( &claimed );
-
-//  MPI_Init(&argc, &argv);
+  //threads never call MPI, only the master does between parallel regions
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided );
   MPI_Comm_size(MPI_COMM_WORLD, &nnodes);
   MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+  if (provided < MPI_THREAD_FUNNELED) {
+    if (my_rank == 0)
+      fprintf(stderr, "MPI gave thread level %d, need MPI_THREAD_FUNNELED\n",
+              provided);
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
 
-  // if (my_rank == print_node) {
-    // printf( "Query thread level= %d  Init_thread level= %d\n", claimed, provided );
-    // printf( "Defined LEVEL= %d  (ompi_info | grep -i thread) \n", MPI_THREAD_MULTIPLE);
-  // }
-	        
-
-  mpi_chunksize = nptsside/nnodes;
+#ifdef _OPENMP
+  setschedule("dynamic");
+#endif
+
+  int c;
+  while ((c = getopt(argc, argv, "s:p:c:vP:Vo:t:x:y:w:a:z")) != -1) {
+    switch (c) {
+    case 's':
+#ifdef _OPENMP
+      setschedule(optarg);
+#endif
+      break;
+    case 'p':
+      if (strcmp(optarg, "block") == 0) partition = PART_BLOCK;
+      else if (strcmp(optarg, "cost") == 0) partition = PART_COST;
+      else partition = PART_RANDOM;
+      break;
+    case 'c': tilecols = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+    case 'v': verbose = 1; break;
+    case 'P':
+      if (strcmp(optarg, "float") == 0) kernel = PREC_FLOAT;
+      else if (strcmp(optarg, "double") == 0) kernel = PREC_DOUBLE;
+      else kernel = -1;
+      break;
+    case 'V': verify = 1; break;
+    case 'o': outname = optarg; break;
+    case 't': outraw = (strcmp(optarg, "raw") == 0); break;
+    case 'x': cx = strtohp(optarg); break;
+    case 'y': cy = strtohp(optarg); break;
+    case 'w': span = atof(optarg); break;
+    case 'a': aspect = atof(optarg); break;
+    case 'z': deepzoom = 1; break;
+    default:
+      if (my_rank == 0)
+        fprintf(stderr, "usage: %s [-s sched[,chunk]] [-p random|block|cost] "
+                "[-c tilecols] [-v] [-P float|double|auto] [-V] [-o file] [-t pgm|raw] [-x cx] [-y cy] "
+                "[-w span] [-a aspect] [-z] nptsside\n", argv[0]);
+      MPI_Finalize();
+      return 1;
+    }
+  }
+  nptsside = atoi(argv[optind]);
+  // print_node = atoi(argv[2]);
+  if (!(span > 0) || !(aspect > 0)) {
+    if (my_rank == 0)
+      fprintf(stderr, "%s: span and aspect must be positive\n", argv[0]);
+    MPI_Finalize();
+    return 1;
+  }
+  //the perturbation kernel has no float version to compare against
+  if (verify && deepzoom) {
+    if (my_rank == 0)
+      fprintf(stderr, "%s: -V does not work with -z\n", argv[0]);
+    MPI_Finalize();
+    return 1;
+  }
+  if (verify && kernel >= 0 && my_rank == 0)
+    fprintf(stderr, "%s: -V compares float against double, ignoring -P\n",
+            argv[0]);
+  nptsy = (int) (nptsside / aspect + 0.5);
+  pixsize = span / nptsside;
+  if (deepzoom)
+    referenceorbit();
+  if (verify)
+    kernel = PREC_DOUBLE;
+  else if (kernel < 0)
+    kernel = choosekernel();
+  if (verbose && my_rank == 0)
+    printf("%s kernel\n", deepzoom ? "perturbation" :
+           kernel == PREC_FLOAT ? "float" : "double");
+
+  //every column gets computed: the first few ranks take one extra
+  int *counts = malloc(nnodes*sizeof(int));
+  int *displs = malloc(nnodes*sizeof(int));
+  int r;
+  for (r=0; r < nnodes; r++) {
+    counts[r] = nptsside/nnodes + (r < nptsside%nnodes ? 1 : 0);
+    displs[r] = r ? displs[r-1] + counts[r-1] : 0;
+  }
+  mpi_chunksize = counts[my_rank];
 
   struct timespec bgn,nd;
   clock_gettime(CLOCK_REALTIME, &bgn);
 
-  // #ifdef RC
-  scram = rpermute(nptsside, 0);
-  MPI_Scatter(scram, mpi_chunksize, MPI_INT, scram, mpi_chunksize, MPI_INT, 0, MPI_COMM_WORLD);
-  // #else
+  if (verbose)
+    reportaffinity();
 
-    // findmyrange(nptsside, nnodes, my_rank, myrange);
-    // scram = rpermute(mpi_chunksize, myrange[0]);
-    // printf("My range is %d %d \n", myrange[0], myrange[1]);
-  // #endif
+  if (partition == PART_COST)
+    costpartition(counts, displs);
+  mpi_chunksize = counts[my_rank];
+
+  scram = malloc((mpi_chunksize+1)*sizeof(int));
+  if (partition != PART_RANDOM) {
+    int i;
+    for (i=0; i < mpi_chunksize; i++) scram[i] = displs[my_rank] + i;
+  } else {
+    int i;
+    for (i=0; i < mpi_chunksize; i++)
+      scram[i] = (int) philox_permute(PERMSEED, nptsside, displs[my_rank] + i);
+  }
 
-  
   dowork();
 
   //implied barrier
 
-  
 
-  // if (tot_count>0) {
-  //   printf("Master is %d ", my_rank);
-  //   printf("%f\n", timediff(bgn,nd));
-  // }else {
-  // printf("Slave is %d ", my_rank);
-  // printf("%f\n", timediff(bgn,nd));
-  // }
 
   // printf("%d %d ", tot_count, my_rank);
   printf("%d ", my_rank);
   clock_gettime(CLOCK_REALTIME, &nd);
   printf("%f\n", timediff(bgn,nd));
 
+  if (deepzoom) {
+    free(refr);
+    free(refi);
+  }
+  free(scram);
+  free(counts);
+  free(displs);
   MPI_Finalize();
 }
@@ -1,17 +1,43 @@
+/*
+ * Hybrid MPI+OpenMP version of simple_n_body.c. The force sum runs on a
+ * structure-of-arrays copy of the bodies with the SIMD kernels in
+ * ../gravity.c, with the Barnes-Hut tree code in ../barnes_hut.c if an
+ * opening angle theta > 0 is given, or with the P3M mesh solver in
+ * ../particle_mesh.c for "pm" (default mesh 256). Each rank owns a
+ * contiguous block of bodies for the whole run and the ranks share only
+ * positions, with an MPI_Allgatherv after every step. Build and run with
+ *
+ *   mpicc -O3 -march=native -fopenmp -I.. -I../../common -o hybrid2 \
+ *       hybrid2.c ../gravity.c ../barnes_hut.c ../particle_mesh.c -lm
+ *   mpiexec -n <ranks> ./hybrid2 <number of bodies> <threads per rank>
+ *       [theta | pm [mesh]]
+ */
 #include <mpi.h>
+#include <omp.h>
 #include <stdio.h>
 #include <math.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "philox.h"
+#include "gravity.h"
+#include "barnes_hut.h"
+#include "particle_mesh.h"
 
 
 #define G             6.67384E-11
 #define DT	          0.001   
         
-int nbodynum,chunksize;
+int nbodynum;
 int nnodes;
 int my_rank;
 int number_threads;
+float theta = 0;      // Barnes-Hut opening angle, 0 for the direct sum
+BHTree tree;
+int mesh = 0;         // P3M mesh size, 0 for no mesh
+PMGrid pm;
 
 typedef float data_t;
 
@@ -30,72 +56,79 @@ typedef struct forceVec {
 }Force;
 
 
-data_t fRand(float,float,int);
+// Body i takes its mass, position and velocity from element i of two
+// Philox streams (common/philox.h), so the bodies can be drawn in
+// parallel and come out the same however the work is split
+#define BODY_SEED 12827467
+
+data_t fRand(float,float,uint32_t);
 
 int initBodies(Body* bodies, int Num)
 {
-  int i,mult=12827467;
+  int i;
+#pragma omp parallel for
   for(i=0; i< Num; i++)
   {
-    bodies[i].mass = fRand(100000.0,-100000.0,i);
-    bodies[i].x_pos = fRand(10,-10,i+mult);
-    bodies[i].y_pos = fRand(10,-10,i+2*mult);
-    bodies[i].x_vel = fRand(10,-10,i+3*mult);
-    bodies[i].y_vel = fRand(10,-10,i+4*mult);
-    mult+=81722171%192323820820392;
+    philox4x32_t r = philox4x32(BODY_SEED, 0, i);
+    philox4x32_t s = philox4x32(BODY_SEED, 1, i);
+    bodies[i].mass = fRand(100000.0,-100000.0,r.v[0]);
+    bodies[i].x_pos = fRand(10,-10,r.v[1]);
+    bodies[i].y_pos = fRand(10,-10,r.v[2]);
+    bodies[i].x_vel = fRand(10,-10,r.v[3]);
+    bodies[i].y_vel = fRand(10,-10,s.v[0]);
   }
+  return Num;
 }
 
-data_t fRand(float max, float min, int seed)     
+data_t fRand(float max, float min, uint32_t w)
 {
-  srand(seed);
-  return (data_t) (min + ((float)(rand()/(float)RAND_MAX)*(float)(max-min)));
+  return (data_t) (min + philox_f01(w)*(max-min));
 }
 
 
-int findmyrange(int n, int nth, int me)
-{
-  int chunksize = n / nth;
-  int range;
-  range = me * chunksize;
-  return range;
-}
-
-void NbodyCalc(Body* bodyArr, int totalNum, Body* subArr,int chunksize)
+// Step bodies first..first+count-1, the ones this rank owns, of the whole
+// set held in soa. Each thread takes a slice of the range. With checkError
+// the tree or mesh code prints its error against the direct sum.
+void NbodyCalc(BodiesSoA* soa, int first, int count, int checkError)
 {
-  int i,j;
-  data_t posTemp[totalNum*2];
-omp_set_num_threads(number_threads);   
-#pragma omp parallel private(j)
+  data_t* x_acc = (data_t*) malloc(count*sizeof(data_t));
+  data_t* y_acc = (data_t*) malloc(count*sizeof(data_t));
+omp_set_num_threads(number_threads);
+if (theta > 0 || mesh > 0)
 {
-  #pragma omp for schedule(static)
-  for(i=0;i<chunksize;i++)
-  {
-    data_t x_acc=0;
-    data_t y_acc=0;
-    for(j=0;j<totalNum;j++)
-    {
-      data_t dx = subArr[i].x_pos - bodyArr[j].x_pos;
-      data_t dy = subArr[i].y_pos - bodyArr[j].y_pos;
-      data_t inv = 1.0/sqrt(dx*dx + dy*dy);
-      data_t force = G*bodyArr[j].mass*subArr[i].mass*inv*inv;
-      x_acc += force*dx;
-      y_acc += force*dy;
-    }
-    posTemp[i*2] = subArr[i].x_pos + DT*(subArr[i].x_vel) + 0.5*DT*DT*(x_acc);
-    posTemp[i*2+1] = subArr[i].y_pos + DT*(subArr[i].y_vel) + 0.5*DT*DT*(y_acc);
-    subArr[i].x_vel+= DT*(x_acc);
-    subArr[i].y_vel+= DT*(y_acc);
+  // every rank builds the whole tree or mesh, then uses it for its bodies
+  if (mesh > 0) {
+    pmAccel(&pm, soa, first, first+count, G, x_acc, y_acc);
+  } else {
+    bhBuild(&tree, soa, theta);
+    bhAccel(&tree, soa, first, first+count, G, x_acc, y_acc);
   }
-
- for(i = 0; i < chunksize; i++)
+  if (checkError)
   {
-    subArr[i].x_pos = posTemp[i*2];
-    subArr[i].y_pos = posTemp[i*2+1];
+    double rms, worst;
+    int nc = (count < 1000) ? count : 1000;
+    gravityError(soa, first, first+nc, G, x_acc, y_acc, &rms, &worst);
+    printf("%s, relative error over %d bodies: rms %.3e, worst %.3e\n",
+           mesh > 0 ? "P3M" : "Barnes-Hut", nc, rms, worst);
   }
 }
+else
+{
+#pragma omp parallel
+{
+  int nth = omp_get_num_threads();
+  int me = omp_get_thread_num();
+  int lo = me*count/nth;
+  int hi = (me+1)*count/nth;
+  gravityAccel(soa, first+lo, first+hi, G, x_acc+lo, y_acc+lo);
+}
 }
 
+  // all accelerations are in hand, so the owned bodies can move in place
+  gravityUpdate(soa, first, first+count, DT, x_acc, y_acc);
+  free(x_acc);
+  free(y_acc);
+}
 
 struct timespec diff(struct timespec start, struct timespec end)
 {
@@ -118,46 +151,65 @@ void main(int argc, char **argv)
   struct timespec time_stamp;
 
   nbodynum = atoi(argv[1]);
-  number_threads ＝ atoi(argv[2]);
-  Body b[nbodynum];
+  number_threads = atoi(argv[2]);
+  if (argc > 3 && strcmp(argv[3], "pm") == 0)
+    mesh = (argc > 4) ? atoi(argv[4]) : 256;
+  else if (argc > 3)
+    theta = atof(argv[3]);
 
-  int provided, claimed;
+  int claimed;
   MPI_Init(&argc, &argv);
   MPI_Query_thread(&claimed);
   MPI_Comm_size(MPI_COMM_WORLD, &nnodes);
   MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
-  chunksize = nbodynum/nnodes;
- 
 
-  const int nitems=5;
-  int blocklengths[5] = {1,1,1,1,1};
-  MPI_Datatype types[5] = {MPI_FLOAT,MPI_FLOAT,MPI_FLOAT,MPI_FLOAT,MPI_FLOAT};
-  MPI_Datatype mpi_body_type;
-  MPI_Aint     offsets[5];
-
-  offsets[0] = offsetof(Body, mass);
-  offsets[1] = offsetof(Body, x_pos);
-  offsets[2] = offsetof(Body, y_pos);
-  offsets[3] = offsetof(Body, x_vel);
-  offsets[4] = offsetof(Body, y_vel);
+  // rank r owns bodies displs[r]..displs[r]+counts[r]-1 for the whole run;
+  // the first nbodynum % nnodes ranks take one extra body
+  int* counts = (int*) malloc(nnodes*sizeof(int));
+  int* displs = (int*) malloc(nnodes*sizeof(int));
+  int r;
+  for(r=0;r<nnodes;r++){
+    counts[r] = nbodynum/nnodes + (r < nbodynum%nnodes);
+    displs[r] = (r == 0) ? 0 : displs[r-1] + counts[r-1];
+  }
+  int first = displs[my_rank];
+  int count = counts[my_rank];
+
+  // every rank draws all the bodies itself: they are a function of the
+  // body number alone, so this is cheaper than sending them round, and
+  // after that only positions travel, since masses never change and each
+  // rank keeps the velocities of its own bodies
+  Body* b = (Body*) malloc(nbodynum*sizeof(Body));
+  initBodies(b,nbodynum);
 
-  MPI_Type_create_struct(nitems, blocklengths, offsets, types, &mpi_body_type);
-  MPI_Type_commit(&mpi_body_type);
+  BodiesSoA soa;
+  bodiesAlloc(&soa,nbodynum);
+  int i,z;
+  for(i=0;i<nbodynum;i++){
+    soa.mass[i] = b[i].mass;
+    soa.x_pos[i] = b[i].x_pos;
+    soa.y_pos[i] = b[i].y_pos;
+    soa.x_vel[i] = b[i].x_vel;
+    soa.y_vel[i] = b[i].y_vel;
+  }
+  free(b);
 
-  initBodies(b,nbodynum);
-  
   clock_gettime(CLOCK_REALTIME, &time1);
-  Body update_body[nbodynum];
-  int z;
+  bhInit(&tree);
+  if (mesh > 0) pmInit(&pm, mesh, 2.0, 4.5);
   for(z=0;z<1000;z++){
-      MPI_Bcast(b,nbodynum,mpi_body_type,0,MPI_COMM_WORLD);
-      MPI_Barrier(MPI_COMM_WORLD);
-      Body sub_b[chunksize];
-      MPI_Scatter(b,chunksize,mpi_body_type,sub_b,chunksize,mpi_body_type,0,MPI_COMM_WORLD);
-      NbodyCalc(b,nbodynum,sub_b,chunksize);
-      MPI_Gather(&sub_b,chunksize,mpi_body_type,b,chunksize, mpi_body_type,0,MPI_COMM_WORLD);
+      NbodyCalc(&soa,first,count,z == 0 && my_rank == 0);
+      // every rank needs every position for the next step; 2 floats per
+      // body instead of the 5 the Bcast/Scatter/Gather round trip moved
+      MPI_Allgatherv(MPI_IN_PLACE,0,MPI_DATATYPE_NULL,soa.x_pos,counts,displs,MPI_FLOAT,MPI_COMM_WORLD);
+      MPI_Allgatherv(MPI_IN_PLACE,0,MPI_DATATYPE_NULL,soa.y_pos,counts,displs,MPI_FLOAT,MPI_COMM_WORLD);
   }
   clock_gettime(CLOCK_REALTIME, &time2);
+  bodiesFree(&soa);
+  bhFree(&tree);
+  if (mesh > 0) pmFree(&pm);
+  free(counts);
+  free(displs);
   // time_stamp = diff(time1,time2);
   
   if (my_rank == 0){
@@ -0,0 +1,375 @@
+/*
+ * Barnes-Hut tree code for the gravitational sum of gravity.c.
+ *
+ * The bodies are sorted along a Morton (Z-order) curve, so that every
+ * square cell of the quadtree is a contiguous range of the sorted
+ * arrays. The tree is built top down by splitting those ranges on
+ * successive pairs of key bits. The 4^BH_TOP cells at depth BH_TOP
+ * are built as independent subtrees by OpenMP threads and then
+ * spliced in after the few nodes above them.
+ *
+ * Nodes are stored depth first with a "next" index past each subtree,
+ * so the walk for one body is a single loop over an array: accept the
+ * node and jump to next, or step to k+1 to open it.
+ *
+ * Masses here can be negative, so the centre of mass is not a useful
+ * expansion point (the total mass of a cell can be near zero). Each
+ * cell is expanded about the |m|-weighted centre instead, with the
+ * monopole and the dipole term. A cell is accepted when
+ * side < theta * distance and the body is not inside it. Leaves of at
+ * most BH_LEAF bodies are summed directly.
+ *
+ * The far field of a cell with mass M and dipole D about centre c is
+ *   sum_j m_j (x - x_j)/|x - x_j|^2 ~ M d/r^2 - D/r^2 + 2 d (d.D)/r^4
+ * with d = x - c, the same kernel as NbodyCalc().
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "barnes_hut.h"
+
+#define BH_LEAF   8     // most bodies in a leaf
+#define BH_TOP    3     // depth of the subtrees built in parallel
+#define BH_BITS   16    // key bits per dimension
+
+void bhInit(BHTree* t)
+{
+  memset(t, 0, sizeof(*t));
+}
+
+void bhFree(BHTree* t)
+{
+  free(t->key);
+  free(t->order);
+  free(t->mass);
+  free(t->x_pos);
+  free(t->y_pos);
+  free(t->node);
+}
+
+// spread the low 16 bits of v to the even bits of the result
+static unsigned spreadBits(unsigned v)
+{
+  v &= 0xffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+// LSD radix sort of the keys, carrying the body indices along
+static void sortKeys(int n, unsigned* key, int* order)
+{
+  unsigned* k2 = (unsigned*) malloc(n*sizeof(unsigned));
+  int* o2 = (int*) malloc(n*sizeof(int));
+  int pass,i;
+
+  for(pass=0;pass<4;pass++)
+  {
+    int count[257];
+    int shift = 8*pass;
+    memset(count, 0, sizeof(count));
+    for(i=0;i<n;i++)
+      count[((key[i] >> shift) & 0xff)+1]++;
+    for(i=0;i<256;i++)
+      count[i+1] += count[i];
+    for(i=0;i<n;i++)
+    {
+      int d = count[(key[i] >> shift) & 0xff]++;
+      k2[d] = key[i];
+      o2[d] = order[i];
+    }
+    memcpy(key, k2, n*sizeof(unsigned));
+    memcpy(order, o2, n*sizeof(int));
+  }
+  free(k2);
+  free(o2);
+}
+
+// first sorted body in lo..hi-1 whose key is >= k
+static int lowerBound(const unsigned* key, int lo, int hi, unsigned k)
+{
+  while(lo < hi)
+  {
+    int mid = lo + (hi-lo)/2;
+    if(key[mid] < k) lo = mid+1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// monopole and dipole of the bodies in a node's range
+static void nodeMoments(const BHTree* t, BHNode* nd)
+{
+  double wsum=0, wx=0, wy=0, m=0, dx=0, dy=0;
+  int i;
+  for(i=nd->first;i<nd->first+nd->count;i++)
+  {
+    double w = fabs(t->mass[i]);
+    wsum += w;
+    wx += w*t->x_pos[i];
+    wy += w*t->y_pos[i];
+  }
+  nd->x_ctr = (wsum > 0) ? wx/wsum : nd->x_min + nd->side/2;
+  nd->y_ctr = (wsum > 0) ? wy/wsum : nd->y_min + nd->side/2;
+  for(i=nd->first;i<nd->first+nd->count;i++)
+  {
+    m += t->mass[i];
+    dx += t->mass[i]*(t->x_pos[i] - nd->x_ctr);
+    dy += t->mass[i]*(t->y_pos[i] - nd->y_ctr);
+  }
+  nd->mass = m;
+  nd->x_dip = dx;
+  nd->y_dip = dy;
+}
+
+typedef struct nodeBuf {
+  int nnodes, nalloc;
+  BHNode* node;
+}NodeBuf;
+
+static int pushNode(NodeBuf* nb)
+{
+  if(nb->nnodes == nb->nalloc)
+  {
+    nb->nalloc = nb->nalloc ? 2*nb->nalloc : 64;
+    nb->node = (BHNode*) realloc(nb->node, nb->nalloc*sizeof(BHNode));
+  }
+  return nb->nnodes++;
+}
+
+// Depth-first build of the cell with the given corner at the given
+// level, holding sorted bodies lo..hi-1, into nb. Returns the number
+// of nodes written.
+static int buildCell(const BHTree* t, NodeBuf* nb, int lo, int hi,
+                     int level, float x_min, float y_min, float side)
+{
+  int k = pushNode(nb);
+  int start = nb->nnodes;
+  BHNode* nd = &nb->node[k];
+
+  nd->x_min = x_min;
+  nd->y_min = y_min;
+  nd->side = side;
+  nd->first = lo;
+  nd->count = hi-lo;
+  nd->leaf = (hi-lo <= BH_LEAF || level == BH_BITS);
+  nodeMoments(t, nd);
+
+  if(!nd->leaf)
+  {
+    int shift = 2*(BH_BITS-1-level);
+    unsigned base = t->key[lo] & ~((2u << shift << 1) - 1);  // this cell's prefix
+    int q, b0 = lo;
+    float h = side/2;
+    for(q=0;q<4;q++)
+    {
+      int b1 = (q == 3) ? hi :
+        lowerBound(t->key, b0, hi, base + ((unsigned) (q+1) << shift));
+      if(b1 > b0)
+        buildCell(t, nb, b0, b1, level+1, x_min + (q & 1)*h,
+                  y_min + (q >> 1)*h, h);
+      b0 = b1;
+    }
+  }
+  nb->node[k].next = k + 1 + (nb->nnodes - start);
+  return nb->nnodes - k;
+}
+
+// Emit the top BH_TOP levels of the tree into t, splicing in the
+// subtrees built in parallel below them
+static void spliceTop(BHTree* t, NodeBuf* sub, int lo, int hi, int level,
+                      unsigned cell, float x_min, float y_min, float side)
+{
+  int k, q;
+  if(level == BH_TOP)
+  {
+    NodeBuf* s = &sub[cell];
+    int off = t->nnodes;
+    for(q=0;q<s->nnodes;q++)
+    {
+      t->node[off+q] = s->node[q];
+      t->node[off+q].next += off;
+    }
+    t->nnodes += s->nnodes;
+    return;
+  }
+
+  k = t->nnodes++;
+  t->node[k].x_min = x_min;
+  t->node[k].y_min = y_min;
+  t->node[k].side = side;
+  t->node[k].first = lo;
+  t->node[k].count = hi-lo;
+  t->node[k].leaf = 0;
+  nodeMoments(t, &t->node[k]);
+  {
+    int shift = 2*(BH_BITS-1-level);
+    int b0 = lo;
+    float h = side/2;
+    for(q=0;q<4;q++)
+    {
+      unsigned c = (cell << 2) | q;
+      int b1 = (q == 3) ? hi :
+        lowerBound(t->key, b0, hi, (c+1) << shift);
+      if(b1 > b0)
+        spliceTop(t, sub, b0, b1, level+1, c, x_min + (q & 1)*h,
+                  y_min + (q >> 1)*h, h);
+      b0 = b1;
+    }
+  }
+  t->node[k].next = t->nnodes;
+}
+
+void bhBuild(BHTree* t, const BodiesSoA* b, float theta)
+{
+  int n = b->n, i, c, ntop = 1 << (2*BH_TOP);
+  float x_lo = b->x_pos[0], x_hi = b->x_pos[0];
+  float y_lo = b->y_pos[0], y_hi = b->y_pos[0];
+  float side, scale;
+  NodeBuf* sub;
+  int* top;
+
+  if(n > t->n)
+  {
+    t->key = (unsigned*) realloc(t->key, n*sizeof(unsigned));
+    t->order = (int*) realloc(t->order, n*sizeof(int));
+    t->mass = (float*) realloc(t->mass, n*sizeof(float));
+    t->x_pos = (float*) realloc(t->x_pos, n*sizeof(float));
+    t->y_pos = (float*) realloc(t->y_pos, n*sizeof(float));
+  }
+  t->n = n;
+  t->theta = theta;
+
+  // bounding square of the bodies
+#pragma omp parallel for reduction(min:x_lo,y_lo) reduction(max:x_hi,y_hi)
+  for(i=0;i<n;i++)
+  {
+    x_lo = fminf(x_lo, b->x_pos[i]);
+    x_hi = fmaxf(x_hi, b->x_pos[i]);
+    y_lo = fminf(y_lo, b->y_pos[i]);
+    y_hi = fmaxf(y_hi, b->y_pos[i]);
+  }
+  side = fmaxf(x_hi - x_lo, y_hi - y_lo);
+  side = (side > 0) ? side*1.0001f : 1.0f;
+  scale = (1 << BH_BITS)/side;
+
+  // Morton keys, then sort the bodies along the curve
+#pragma omp parallel for
+  for(i=0;i<n;i++)
+  {
+    unsigned ix = (unsigned) ((b->x_pos[i] - x_lo)*scale);
+    unsigned iy = (unsigned) ((b->y_pos[i] - y_lo)*scale);
+    if(ix > 0xffff) ix = 0xffff;
+    if(iy > 0xffff) iy = 0xffff;
+    t->key[i] = spreadBits(ix) | (spreadBits(iy) << 1);
+    t->order[i] = i;
+  }
+  sortKeys(n, t->key, t->order);
+#pragma omp parallel for
+  for(i=0;i<n;i++)
+  {
+    t->mass[i] = b->mass[t->order[i]];
+    t->x_pos[i] = b->x_pos[t->order[i]];
+    t->y_pos[i] = b->y_pos[t->order[i]];
+  }
+
+  // subtrees below depth BH_TOP, one per cell there, in parallel
+  sub = (NodeBuf*) calloc(ntop, sizeof(NodeBuf));
+  top = (int*) malloc((ntop+1)*sizeof(int));
+  for(c=0;c<ntop;c++)
+    top[c] = lowerBound(t->key, 0, n, (unsigned) c << (2*(BH_BITS-BH_TOP)));
+  top[ntop] = n;
+#pragma omp parallel for schedule(dynamic)
+  for(c=0;c<ntop;c++)
+  {
+    if(top[c+1] > top[c])
+    {
+      unsigned ix = 0, iy = 0;
+      int l;
+      float h = side/(1 << BH_TOP);
+      for(l=0;l<BH_TOP;l++)
+      {
+        ix |= ((c >> (2*l)) & 1) << l;
+        iy |= ((c >> (2*l+1)) & 1) << l;
+      }
+      buildCell(t, &sub[c], top[c], top[c+1], BH_TOP, x_lo + ix*h,
+                y_lo + iy*h, h);
+    }
+  }
+
+  // splice them under the top levels
+  {
+    int total = ntop;
+    for(c=0;c<ntop;c++)
+      total += sub[c].nnodes;
+    if(total > t->nalloc)
+    {
+      t->nalloc = total;
+      t->node = (BHNode*) realloc(t->node, total*sizeof(BHNode));
+    }
+  }
+  t->nnodes = 0;
+  spliceTop(t, sub, 0, n, 0, 0, x_lo, y_lo, side);
+
+  for(c=0;c<ntop;c++)
+    free(sub[c].node);
+  free(sub);
+  free(top);
+}
+
+// acceleration of bodies i0..i1-1 of b, as gravityAccel()
+void bhAccel(const BHTree* t, const BodiesSoA* b, int i0, int i1, float g,
+             float* x_acc, float* y_acc)
+{
+  float theta2 = t->theta*t->theta;
+  int i;
+
+#pragma omp parallel for schedule(dynamic,64)
+  for(i=i0;i<i1;i++)
+  {
+    float xi = b->x_pos[i], yi = b->y_pos[i];
+    float ax = 0, ay = 0;
+    int k = 0;
+
+    while(k < t->nnodes)
+    {
+      const BHNode* nd = &t->node[k];
+      float dx = xi - nd->x_ctr, dy = yi - nd->y_ctr;
+      float r2 = dx*dx + dy*dy;
+      int inside = xi >= nd->x_min && xi <= nd->x_min + nd->side &&
+                   yi >= nd->y_min && yi <= nd->y_min + nd->side;
+
+      if(!inside && nd->side*nd->side < theta2*r2)
+      {
+        float inv2 = 1.0f/r2;
+        float dd = 2*(dx*nd->x_dip + dy*nd->y_dip)*inv2;
+        ax += inv2*(nd->mass*dx - nd->x_dip + dd*dx);
+        ay += inv2*(nd->mass*dy - nd->y_dip + dd*dy);
+        k = nd->next;
+      }
+      else if(nd->leaf)
+      {
+        int j;
+        for(j=nd->first;j<nd->first+nd->count;j++)
+        {
+          float ex = xi - t->x_pos[j], ey = yi - t->y_pos[j];
+          float s2 = ex*ex + ey*ey;
+          if(s2 > 0){
+            float s = t->mass[j]/s2;
+            ax += s*ex;
+            ay += s*ey;
+          }
+        }
+        k = nd->next;
+      }
+      else
+        k = k+1;
+    }
+    x_acc[i-i0] = g*b->mass[i]*ax;
+    y_acc[i-i0] = g*b->mass[i]*ay;
+  }
+}
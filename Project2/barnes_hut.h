@@ -0,0 +1,35 @@
+#ifndef BARNES_HUT_H
+#define BARNES_HUT_H
+
+#include "gravity.h"
+
+/* One square cell of the tree. Nodes are stored depth first, so the
+ * first child of node k (if any) is node k+1, and next is the node
+ * after k's whole subtree */
+typedef struct bhNode {
+  float x_min, y_min, side;  // the cell
+  float x_ctr, y_ctr;        // expansion centre
+  float mass;                // total mass
+  float x_dip, y_dip;        // mass dipole about the centre
+  int first, count;          // bodies first..first+count-1 in Morton order
+  int leaf;                  // 1 if the bodies are summed directly
+  int next;                  // node after this subtree
+}BHNode;
+
+typedef struct bhTree {
+  int n;
+  int nnodes, nalloc;
+  float theta;               // opening angle
+  unsigned* key;             // Morton keys, sorted
+  int* order;                // body index of each sorted key
+  float *mass, *x_pos, *y_pos;   // bodies in Morton order
+  BHNode* node;
+}BHTree;
+
+void bhInit(BHTree* t);
+void bhBuild(BHTree* t, const BodiesSoA* b, float theta);
+void bhAccel(const BHTree* t, const BodiesSoA* b, int i0, int i1, float g,
+             float* x_acc, float* y_acc);
+void bhFree(BHTree* t);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef GRAVITY_H
+#define GRAVITY_H
+
+/* Lanes in one SIMD register of floats on the target we compile for */
+#if defined(__AVX512F__)
+#define GRAV_WIDTH 16
+#elif defined(__AVX2__) && defined(__FMA__)
+#define GRAV_WIDTH 8
+#else
+#define GRAV_WIDTH 1
+#endif
+
+/* Bodies as a structure of arrays: every array is 64-byte aligned and
+ * padded with massless bodies to a multiple of GRAV_WIDTH */
+typedef struct bodies_soa {
+  int n;          // number of bodies
+  int npad;       // n rounded up to a multiple of GRAV_WIDTH
+  float *mass;
+  float *x_pos;
+  float *y_pos;
+  float *x_vel;
+  float *y_vel;
+}BodiesSoA;
+
+void bodiesAlloc(BodiesSoA* b, int n);
+void bodiesFree(BodiesSoA* b);
+void gravityAccel(const BodiesSoA* b, int i0, int i1, float g,
+                  float* x_acc, float* y_acc);
+void gravityUpdate(BodiesSoA* b, int i0, int i1, float dt,
+                   const float* x_acc, const float* y_acc);
+void gravityError(const BodiesSoA* b, int i0, int i1, float g,
+                  const float* x_acc, const float* y_acc,
+                  double* rms, double* worst);
+
+#endif
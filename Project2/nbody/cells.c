@@ -0,0 +1,345 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "cells.h"
+
+
+/*@T
+ * \section{Cell lists}
+ *
+ * The Lennard-Jones force vanishes beyond $r_c = 2.5 \sigma$, so
+ * for anything but tiny systems most of the $O(n^2)$ pair loop is
+ * spent computing zeros.  We cover the box with a uniform grid of
+ * cells whose sides are at least $r_c$; then every partner of a
+ * particle lives either in its own cell or in one of the eight
+ * surrounding ones, and the work is proportional to $n$ times the
+ * (bounded) number of particles per cell.
+ *
+ * The grid depends only on the cutoff, so [[cells_init]] sets it up
+ * once; the per-particle arrays grow on demand in [[cells_bin]].
+ *@c*/
+void cells_init(cell_list_t* cl, float rcut)
+{
+    cl->nx = (int) ((XMAX-XMIN)/rcut);
+    cl->ny = (int) ((YMAX-YMIN)/rcut);
+    if (cl->nx < 1) cl->nx = 1;
+    if (cl->ny < 1) cl->ny = 1;
+    cl->hx = (XMAX-XMIN)/cl->nx;
+    cl->hy = (YMAX-YMIN)/cl->ny;
+    cl->start  = (int*) malloc((cl->nx*cl->ny+1)*sizeof(int));
+    cl->idx    = NULL;
+    cl->cell   = NULL;
+    cl->nalloc = 0;
+}
+
+void cells_free(cell_list_t* cl)
+{
+    free(cl->cell);
+    free(cl->idx);
+    free(cl->start);
+}
+
+/*@T
+ *
+ * Binning is a counting sort: count the particles per cell, take a
+ * prefix sum to get the cell offsets, and drop each particle into
+ * place.  Particles that are (slightly) outside the box go into the
+ * nearest boundary cell.
+ *@c*/
+static int cell_of(const cell_list_t* cl, float x, float y)
+{
+    int ix = (int) ((x-XMIN)/cl->hx);
+    int iy = (int) ((y-YMIN)/cl->hy);
+    if (ix < 0) ix = 0;
+    if (iy < 0) iy = 0;
+    if (ix >= cl->nx) ix = cl->nx-1;
+    if (iy >= cl->ny) iy = cl->ny-1;
+    return iy*cl->nx + ix;
+}
+
+void cells_bin(cell_list_t* cl, int n, const float* restrict x)
+{
+    int ncells = cl->nx*cl->ny;
+    int* start = cl->start;
+
+    if (n > cl->nalloc) {
+        cl->nalloc = n;
+        cl->idx  = (int*) realloc(cl->idx,  n*sizeof(int));
+        cl->cell = (int*) realloc(cl->cell, n*sizeof(int));
+    }
+    cl->nown = n;
+
+    memset(start, 0, (ncells+1)*sizeof(int));
+    for (int i = 0; i < n; ++i) {
+        cl->cell[i] = cell_of(cl, x[2*i+0], x[2*i+1]);
+        ++start[cl->cell[i]+1];
+    }
+    for (int c = 0; c < ncells; ++c)
+        start[c+1] += start[c];
+    for (int i = 0; i < n; ++i)
+        cl->idx[start[cl->cell[i]]++] = i;
+
+    /* The fill loop advanced each start to the next cell's; shift back */
+    for (int c = ncells; c > 0; --c)
+        start[c] = start[c-1];
+    start[0] = 0;
+}
+
+/*@T
+ *
+ * To keep using Newton's third law, each cell only looks at pairs
+ * within itself and at a ``half stencil'' of four neighbours (east,
+ * and the three cells of the row above).  The other four neighbours
+ * see the cell through their own half stencils, so every pair within
+ * the nine-cell neighbourhood is visited exactly once.
+ *
+ * When [[pe]] is not [[NULL]] the same loop also adds up the
+ * potential energy of the pairs into [[*pe]] (see [[diag.c]]).  A
+ * caller that binned ghost copies of other ranks' particles after
+ * its own sets [[nown]] to the number of its own: a pair with one
+ * ghost then counts half, since the other rank counts the other half,
+ * and a pair of ghosts not at all.  The test on [[pe]] is made once
+ * per cell pair rather than once per particle pair: the loop is
+ * written once with a constant [[energy]] flag and inlined twice, so
+ * the version without the energy is exactly the old loop.
+ *@c*/
+static inline void cell_pair_loop(const cell_list_t* cl, int c1, int c2,
+                                  const float* restrict x, float* restrict F,
+                                  float eps, float sig2, double* pe,
+                                  const int energy)
+{
+    const int* idx = cl->idx;
+    double u = 0;
+    for (int a = cl->start[c1]; a < cl->start[c1+1]; ++a) {
+        int i = idx[a];
+        int b0 = (c1 == c2) ? a+1 : cl->start[c2];
+        for (int b = b0; b < cl->start[c2+1]; ++b) {
+            int j = idx[b];
+            float dx = x[2*j+0]-x[2*i+0];
+            float dy = x[2*j+1]-x[2*i+1];
+            float r2 = dx*dx+dy*dy;
+            float C_LJ = compute_LJ_scalar(r2, eps, sig2);
+            F[2*i+0] += (C_LJ*dx);
+            F[2*i+1] += (C_LJ*dy);
+            F[2*j+0] -= (C_LJ*dx);
+            F[2*j+1] -= (C_LJ*dy);
+            if (energy)
+                u += 0.5 * ((i < cl->nown) + (j < cl->nown)) *
+                    potential_LJ_cut(r2, eps, sig2);
+        }
+    }
+    if (energy)
+        *pe += u;
+}
+
+static void cell_pair_forces(const cell_list_t* cl, int c1, int c2,
+                             const float* restrict x, float* restrict F,
+                             float eps, float sig2, double* pe)
+{
+    if (pe)
+        cell_pair_loop(cl, c1, c2, x, F, eps, sig2, pe, 1);
+    else
+        cell_pair_loop(cl, c1, c2, x, F, eps, sig2, NULL, 0);
+}
+
+void cells_LJ_cell_forces(const cell_list_t* cl, int ix, int iy,
+                          const float* restrict x, float* restrict F,
+                          float eps, float sig2, double* pe)
+{
+    static const int stencil[5][2] = {{0,0}, {1,0}, {-1,1}, {0,1}, {1,1}};
+    int nx = cl->nx;
+    int ny = cl->ny;
+
+    for (int s = 0; s < 5; ++s) {
+        int jx = ix + stencil[s][0];
+        int jy = iy + stencil[s][1];
+        if (jx >= 0 && jx < nx && jy < ny)
+            cell_pair_forces(cl, iy*nx+ix, jy*nx+jx, x, F, eps, sig2, pe);
+    }
+}
+
+void cells_LJ_forces(const cell_list_t* cl, const float* restrict x,
+                     float* restrict F, float eps, float sig2, double* pe)
+{
+    for (int iy = 0; iy < cl->ny; ++iy)
+        for (int ix = 0; ix < cl->nx; ++ix)
+            cells_LJ_cell_forces(cl, ix, iy, x, F, eps, sig2, pe);
+}
+
+/*@T
+ * \section{Verlet lists}
+ *
+ * Cell lists still look at nine cells worth of candidates per
+ * particle, and most of them are out of range.  Particles only move
+ * about $v \Delta t$ per step, so it pays to remember who is close.
+ * A Verlet list records, for each particle, the neighbours within
+ * $r_c + r_s$ for some skin radius $r_s$.  As long as no particle has
+ * moved more than $r_s/2$ since the list was built, no pair can have
+ * closed from beyond $r_c + r_s$ to within $r_c$, and the list is
+ * still complete.  Only then do we rebuild it, using a cell list whose
+ * cells are at least $r_c + r_s$ wide.
+ *
+ * The list stores each pair once (with $j > i$), so the force loop
+ * can still use Newton's third law.
+ *@c*/
+void verlet_init(verlet_list_t* vl, float rcut, float skin)
+{
+    vl->skin     = skin;
+    vl->rlist2   = (rcut+skin)*(rcut+skin);
+    vl->n        = -1;
+    vl->start    = NULL;
+    vl->nbr      = NULL;
+    vl->x0       = NULL;
+    vl->nalloc   = 0;
+    vl->nbralloc = 0;
+    vl->nbuild   = 0;
+    vl->ncalls   = 0;
+    vl->npairs   = 0;
+}
+
+void verlet_free(verlet_list_t* vl)
+{
+    free(vl->x0);
+    free(vl->nbr);
+    free(vl->start);
+}
+
+/*@T
+ *
+ * The build makes two sweeps over the half-stencil pairs of the cell
+ * list: one to count the neighbours of each particle, and one to fill
+ * them in.  The [[j > i]] test makes each pair land in the list of its
+ * lower-numbered particle no matter which cell found it.
+ *@c*/
+static void verlet_scan(verlet_list_t* vl, const cell_list_t* cl,
+                        const float* restrict x, int fill)
+{
+    static const int stencil[5][2] = {{0,0}, {1,0}, {-1,1}, {0,1}, {1,1}};
+    const int* idx = cl->idx;
+    int* start = vl->start;
+
+    for (int iy = 0; iy < cl->ny; ++iy) {
+        for (int ix = 0; ix < cl->nx; ++ix) {
+            int c1 = iy*cl->nx+ix;
+            for (int s = 0; s < 5; ++s) {
+                int jx = ix + stencil[s][0];
+                int jy = iy + stencil[s][1];
+                if (jx < 0 || jx >= cl->nx || jy >= cl->ny)
+                    continue;
+                int c2 = jy*cl->nx+jx;
+                for (int a = cl->start[c1]; a < cl->start[c1+1]; ++a) {
+                    int b0 = (c1 == c2) ? a+1 : cl->start[c2];
+                    for (int b = b0; b < cl->start[c2+1]; ++b) {
+                        int i = idx[a] < idx[b] ? idx[a] : idx[b];
+                        int j = idx[a] < idx[b] ? idx[b] : idx[a];
+                        float dx = x[2*j+0]-x[2*i+0];
+                        float dy = x[2*j+1]-x[2*i+1];
+                        if (dx*dx+dy*dy < vl->rlist2) {
+                            if (fill)
+                                vl->nbr[start[i]++] = j;
+                            else
+                                ++start[i+1];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void verlet_build(verlet_list_t* vl, cell_list_t* cl,
+                         int n, const float* restrict x)
+{
+    if (n > vl->nalloc) {
+        vl->nalloc = n;
+        vl->start = (int*)   realloc(vl->start, (n+1)*sizeof(int));
+        vl->x0    = (float*) realloc(vl->x0,  2*n*sizeof(float));
+    }
+
+    cells_bin(cl, n, x);
+    memset(vl->start, 0, (n+1)*sizeof(int));
+    verlet_scan(vl, cl, x, 0);
+    for (int i = 0; i < n; ++i)
+        vl->start[i+1] += vl->start[i];
+
+    if (vl->start[n] > vl->nbralloc) {
+        vl->nbralloc = vl->start[n] + vl->start[n]/4;
+        vl->nbr = (int*) realloc(vl->nbr, vl->nbralloc*sizeof(int));
+    }
+    verlet_scan(vl, cl, x, 1);
+    for (int i = n; i > 0; --i)
+        vl->start[i] = vl->start[i-1];
+    vl->start[0] = 0;
+
+    memcpy(vl->x0, x, 2*n*sizeof(float));
+    vl->n = n;
+    vl->npairs += vl->start[n];
+    ++vl->nbuild;
+}
+
+/*@T
+ *
+ * [[verlet_update]] is called before every force evaluation; it
+ * rebuilds the list (and returns nonzero) if the particle count
+ * changed or somebody has moved more than half the skin.
+ *@c*/
+int verlet_update(verlet_list_t* vl, cell_list_t* cl,
+                  int n, const float* restrict x)
+{
+    float maxd2 = 0;
+    float lim2 = vl->skin*vl->skin/4;
+
+    ++vl->ncalls;
+    if (n == vl->n) {
+        for (int i = 0; i < n; ++i) {
+            float dx = x[2*i+0]-vl->x0[2*i+0];
+            float dy = x[2*i+1]-vl->x0[2*i+1];
+            float d2 = dx*dx+dy*dy;
+            maxd2 = (d2 > maxd2) ? d2 : maxd2;
+        }
+        if (maxd2 <= lim2)
+            return 0;
+    }
+    verlet_build(vl, cl, n, x);
+    return 1;
+}
+
+static inline void verlet_loop(const verlet_list_t* vl,
+                               const float* restrict x, float* restrict F,
+                               float eps, float sig2, double* pe,
+                               const int energy)
+{
+    double u = 0;
+    for (int i = 0; i < vl->n; ++i) {
+        float xi = x[2*i+0];
+        float yi = x[2*i+1];
+        float fx = 0, fy = 0;
+        for (int k = vl->start[i]; k < vl->start[i+1]; ++k) {
+            int j = vl->nbr[k];
+            float dx = x[2*j+0]-xi;
+            float dy = x[2*j+1]-yi;
+            float r2 = dx*dx+dy*dy;
+            float C_LJ = compute_LJ_scalar(r2, eps, sig2);
+            fx += (C_LJ*dx);
+            fy += (C_LJ*dy);
+            F[2*j+0] -= (C_LJ*dx);
+            F[2*j+1] -= (C_LJ*dy);
+            if (energy)
+                u += potential_LJ_cut(r2, eps, sig2);
+        }
+        F[2*i+0] += fx;
+        F[2*i+1] += fy;
+    }
+    if (energy)
+        *pe += u;
+}
+
+void verlet_LJ_forces(const verlet_list_t* vl, const float* restrict x,
+                      float* restrict F, float eps, float sig2, double* pe)
+{
+    if (pe)
+        verlet_loop(vl, x, F, eps, sig2, pe, 1);
+    else
+        verlet_loop(vl, x, F, eps, sig2, NULL, 0);
+}
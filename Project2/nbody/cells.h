@@ -0,0 +1,46 @@
+#ifndef CELLS_H
+#define CELLS_H
+
+/* Particles in cell c are idx[start[c]] through idx[start[c+1]-1] */
+typedef struct cell_list_t {
+    int    nx, ny;  /* Number of cells in each direction */
+    float  hx, hy;  /* Cell dimensions (>= cutoff)       */
+    int*   start;   /* Cell offsets into idx (nx*ny+1)   */
+    int*   idx;     /* Particle indices sorted by cell   */
+    int*   cell;    /* Cell of each particle             */
+    int    nalloc;  /* Particles idx and cell can hold   */
+    int    nown;    /* Particles whose energy counts     */
+} cell_list_t;
+
+void cells_init(cell_list_t* cl, float rcut);
+void cells_free(cell_list_t* cl);
+void cells_bin(cell_list_t* cl, int n, const float* restrict x);
+void cells_LJ_cell_forces(const cell_list_t* cl, int ix, int iy,
+                          const float* restrict x, float* restrict F,
+                          float eps, float sig2, double* pe);
+void cells_LJ_forces(const cell_list_t* cl, const float* restrict x,
+                     float* restrict F, float eps, float sig2, double* pe);
+
+/* Neighbours j > i of particle i are nbr[start[i]] to nbr[start[i+1]-1] */
+typedef struct verlet_list_t {
+    float  skin;     /* Extra list radius beyond the cutoff  */
+    float  rlist2;   /* Squared list radius (cutoff + skin)  */
+    int    n;        /* Particles at the last build          */
+    int*   start;    /* Offsets into nbr (n+1)               */
+    int*   nbr;      /* Neighbour indices                    */
+    float* x0;       /* Positions at the last build          */
+    int    nalloc;   /* Particles start and x0 can hold      */
+    int    nbralloc; /* Entries nbr can hold                 */
+    int    nbuild;   /* Number of builds so far              */
+    int    ncalls;   /* Number of updates so far             */
+    long   npairs;   /* Pairs summed over all builds         */
+} verlet_list_t;
+
+void verlet_init(verlet_list_t* vl, float rcut, float skin);
+void verlet_free(verlet_list_t* vl);
+int  verlet_update(verlet_list_t* vl, cell_list_t* cl,
+                   int n, const float* restrict x);
+void verlet_LJ_forces(const verlet_list_t* vl, const float* restrict x,
+                      float* restrict F, float eps, float sig2, double* pe);
+
+#endif /* CELLS_H */
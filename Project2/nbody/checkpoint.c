@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+
+
+/*@T
+ * \section{Checkpoints}
+ *
+ * A long run can outlive the batch system's wall clock limit, and the
+ * trajectory alone is not enough to carry on: it has positions, but
+ * not the velocities and accelerations the leapfrog needs, and only
+ * as many bits as the output format keeps.  So every [[-C]] frames
+ * the drivers also save the complete state at the frame just written:
+ * the parameters that define the dynamics, the seed of the run, the
+ * frame counter, and $x$, $v$ and $a$ at full precision.  With
+ * [[-R]] a driver starts from such a file instead of from random
+ * initial conditions, and the continuation is bit-for-bit the same
+ * as the run that wrote it.
+ *
+ * The file is a fixed-size header followed by $x$, $v$ and $a$ in
+ * particle order, each $2n$ floats in the machine's own byte order
+ * (a checkpoint is for resuming on the same cluster, not for
+ * exchanging data).  We write to a temporary file and rename it over
+ * the old checkpoint at the end, so a job killed in the middle of
+ * writing still leaves the previous checkpoint intact.
+ *@c*/
+#define CKPT_TAG "NBCkpt02"
+
+void ckpt_fill(ckpt_header_t* h, const sim_param_t* params, int frame)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->tag, CKPT_TAG, sizeof(h->tag));
+    h->npart   = params->npart;
+    h->nframes = params->nframes;
+    h->npframe = params->npframe;
+    h->frame   = frame;
+    h->dt      = params->dt;
+    h->eps_lj  = params->eps_lj;
+    h->sig_lj  = params->sig_lj;
+    h->G       = params->G;
+    h->T0      = params->T0;
+    h->seed    = params->seed;
+}
+
+int ckpt_write(const char* fname, const ckpt_header_t* h,
+               const float* x, const float* v, const float* a)
+{
+    size_t len = 2*(size_t) h->npart;
+    char* tmp = (char*) malloc(strlen(fname)+5);
+    FILE* fp;
+    int ok;
+
+    sprintf(tmp, "%s.tmp", fname);
+    fp = fopen(tmp, "wb");
+    if (!fp) {
+        free(tmp);
+        return -1;
+    }
+    ok = (fwrite(h, sizeof(*h), 1, fp) == 1 &&
+          fwrite(x, sizeof(float), len, fp) == len &&
+          fwrite(v, sizeof(float), len, fp) == len &&
+          fwrite(a, sizeof(float), len, fp) == len);
+    ok = (fclose(fp) == 0) && ok;
+    ok = ok && (rename(tmp, fname) == 0);
+    free(tmp);
+    return ok ? 0 : -1;
+}
+
+int ckpt_read_header(const char* fname, ckpt_header_t* h)
+{
+    FILE* fp = fopen(fname, "rb");
+    int ok;
+    if (!fp)
+        return -1;
+    ok = (fread(h, sizeof(*h), 1, fp) == 1 &&
+          memcmp(h->tag, CKPT_TAG, sizeof(h->tag)) == 0 &&
+          h->npart > 0 && h->frame >= 0);
+    fclose(fp);
+    return ok ? 0 : -1;
+}
+
+/*@T
+ *
+ * A reader can ask for any contiguous range of particles, so that
+ * MPI ranks can each pull in just their own part.
+ *@c*/
+int ckpt_read(const char* fname, const ckpt_header_t* h,
+              int first, int count, float* x, float* v, float* a)
+{
+    size_t len = 2*(size_t) count;
+    size_t stride = 2*sizeof(float)*(size_t) h->npart;
+    size_t start = sizeof(*h) + 2*sizeof(float)*(size_t) first;
+    float* dst[3] = { x, v, a };
+    FILE* fp = fopen(fname, "rb");
+    int ok = (fp != NULL);
+
+    for (int k = 0; ok && k < 3; ++k)
+        ok = (fseek(fp, (long) (start + k*stride), SEEK_SET) == 0 &&
+              fread(dst[k], sizeof(float), len, fp) == len);
+    if (fp)
+        fclose(fp);
+    return ok ? 0 : -1;
+}
+
+int ckpt_read_owners(const char* fname, const ckpt_header_t* h,
+                     int* owner)
+{
+    size_t n = h->npart;
+    FILE* fp = fopen(fname, "rb");
+    int ok = (fp != NULL && h->nowner > 0);
+
+    ok = ok && (fseek(fp, (long) (sizeof(*h) + 3*8*n), SEEK_SET) == 0 &&
+                fread(owner, sizeof(int), n, fp) == n);
+    if (fp)
+        fclose(fp);
+    return ok ? 0 : -1;
+}
+
+void ckpt_restore(const ckpt_header_t* h, sim_param_t* params)
+{
+    params->npart   = h->npart;
+    params->nframes = h->nframes;
+    params->npframe = h->npframe;
+    params->dt      = h->dt;
+    params->eps_lj  = h->eps_lj;
+    params->sig_lj  = h->sig_lj;
+    params->G       = h->G;
+    params->T0      = h->T0;
+    params->seed    = h->seed;
+}
+
+/*@T
+ *
+ * On restart the trajectory file is cut back to the frames written
+ * up to the checkpoint (a killed run may have written more), and the
+ * new frames go on the end.  We only do this for [[NBView01]], where
+ * a frame's position in the file follows from its number.
+ *@c*/
+FILE* ckpt_reopen_output(const char* fname, int n, int nframes)
+{
+    char tag[16] = "";
+    long end;
+    FILE* fp = fopen(fname, "r+b");
+
+    if (!fp)
+        return NULL;
+    if (!fgets(tag, sizeof(tag), fp) || strcmp(tag, "NBView01\n") != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    end = ftell(fp) + 2*sizeof(uint32_t) + 8L*n*nframes;
+    fseek(fp, 0, SEEK_END);
+    if (ftell(fp) < end || ftruncate(fileno(fp), end) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    fseek(fp, end, SEEK_SET);
+    return fp;
+}
+
+/*@T
+ *
+ * The shared-memory drivers save and resume through two wrappers.
+ * [[ckpt_resume]] reads the checkpoint named by [[-R]], restores the
+ * parameters and the random number state, allocates and fills $x$,
+ * $v$ and $a$, and reopens the output; it returns the frame to go on
+ * from, or -1 after printing what went wrong.
+ *@c*/
+int ckpt_save(const sim_param_t* params, int frame,
+              const float* x, const float* v, const float* a)
+{
+    ckpt_header_t h;
+    ckpt_fill(&h, params, frame);
+    if (ckpt_write(params->ckpt, &h, x, v, a) != 0) {
+        fprintf(stderr, "Could not write checkpoint %s\n", params->ckpt);
+        return -1;
+    }
+    return 0;
+}
+
+int ckpt_resume(sim_param_t* params, FILE** fp,
+                float** x, float** v, float** a)
+{
+    ckpt_header_t h;
+    int n;
+
+    if (ckpt_read_header(params->restart, &h) != 0) {
+        fprintf(stderr, "%s is not a checkpoint\n", params->restart);
+        return -1;
+    }
+    ckpt_restore(&h, params);
+    n = h.npart;
+    *x = (float*) malloc(2*n*sizeof(float));
+    *v = (float*) malloc(2*n*sizeof(float));
+    *a = (float*) malloc(2*n*sizeof(float));
+    if (ckpt_read(params->restart, &h, 0, n, *x, *v, *a) != 0) {
+        fprintf(stderr, "Checkpoint %s is truncated\n", params->restart);
+        return -1;
+    }
+    *fp = ckpt_reopen_output(params->fname, n, h.frame+1);
+    if (!*fp) {
+        fprintf(stderr, "%s does not hold the %d frames before the "
+                "checkpoint\n", params->fname, h.frame+1);
+        return -1;
+    }
+    return h.frame;
+}
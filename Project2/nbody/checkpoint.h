@@ -0,0 +1,42 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "params.h"
+
+/* Fixed-size header; x, v and a (2*npart floats each) follow it, and
+ * then for nbmpi strips the owning rank of each particle (npart ints) */
+typedef struct ckpt_header_t {
+    char     tag[8];     /* "NBCkpt02"                            */
+    int32_t  npart;      /* Number of particles                   */
+    int32_t  nframes;    /* Frames in the whole run               */
+    int32_t  npframe;    /* Steps per frame                       */
+    int32_t  frame;      /* Last frame written; state is at it    */
+    float    dt;         /* Time step                             */
+    float    eps_lj;     /* Strength for L-J                      */
+    float    sig_lj;     /* Radius for L-J                        */
+    float    G;          /* Gravitational strength                */
+    float    T0;         /* Initial temperature                   */
+    int32_t  nowner;     /* Ranks, if an owner per particle follows */
+    int64_t  seed;       /* Seed of the initial conditions        */
+    int32_t  reserved[2];
+} ckpt_header_t;
+
+void  ckpt_fill(ckpt_header_t* h, const sim_param_t* params, int frame);
+int   ckpt_write(const char* fname, const ckpt_header_t* h,
+                 const float* x, const float* v, const float* a);
+int   ckpt_read_header(const char* fname, ckpt_header_t* h);
+int   ckpt_read(const char* fname, const ckpt_header_t* h,
+                int first, int count, float* x, float* v, float* a);
+int   ckpt_read_owners(const char* fname, const ckpt_header_t* h,
+                       int* owner);
+void  ckpt_restore(const ckpt_header_t* h, sim_param_t* params);
+FILE* ckpt_reopen_output(const char* fname, int n, int nframes);
+int   ckpt_save(const sim_param_t* params, int frame,
+                const float* x, const float* v, const float* a);
+int   ckpt_resume(sim_param_t* params, FILE** fp,
+                  float** x, float** v, float** a);
+
+#endif /* CHECKPOINT_H */
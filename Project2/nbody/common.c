@@ -51,7 +51,7 @@
  *@c*/
 float compute_LJ_scalar(float r2, float eps, float sig2)
 {
-    if (r2 < 6.25*sig2) { /* r_cutoff = 2.5 sigma */
+    if (r2 < LJ_CUTOFF*LJ_CUTOFF*sig2) { /* r_cutoff = 2.5 sigma */
         float z = sig2/r2;
         float u = z*z*z;
         return 24*eps/r2 * u*(1-2*u);
@@ -61,13 +61,29 @@ float compute_LJ_scalar(float r2, float eps, float sig2)
 
 /*@T
  * In order to compute the total energy for monitoring purposes,
- * we also want the potential itself:
+ * we also want the potential itself,
+ * $V_{LJ}(r) = 4\epsilon [(\sigma/r)^{12} - (\sigma/r)^6]$:
  *@c*/
 float potential_LJ(float r2, float eps, float sig2)
 {
     float z = sig2/r2;
     float u = z*z*z;
-    return 4*eps*u*(1-u);
+    return 4*eps*u*(u-1);
+}
+
+/*@T
+ * The force is cut off at $r_c$, so the energy the integrator
+ * conserves is that of the potential cut off at $r_c$ too.  We shift
+ * it by $V_{LJ}(r_c)$ so that it does not jump when a pair crosses the
+ * cutoff; what is left over is the (small) error from the jump in
+ * the force, and the drift we want to see.
+ *@c*/
+float potential_LJ_cut(float r2, float eps, float sig2)
+{
+    float rc2 = LJ_CUTOFF*LJ_CUTOFF*sig2;
+    if (r2 < rc2)
+        return potential_LJ(r2, eps, sig2) - potential_LJ(rc2, eps, sig2);
+    return 0;
 }
 
 /*@q
@@ -137,22 +153,80 @@ void leapfrog2(int n, float dt, float* restrict v, float* restrict a)
  * Verlet.  Currently we don't check if for multiple reflections ---
  * if they occur, something is amiss!
  *@c*/
-static void reflect(float wall, float* restrict x, 
-                    float* restrict v, float* restrict a)
+static inline float reflect(float x, float lo, float hi, float* s)
 {
-    *x = (2*wall-(*x));
-    *v = -(*v);
-    *a = -(*a);
+    float xl = 2*lo-x;
+    *s = (x < lo) ? -1.0f : 1.0f;
+    x  = (x < lo) ? xl : x;
+    float xh = 2*hi-x;
+    *s = (x > hi) ? -(*s) : *s;
+    return (x > hi) ? xh : x;
 }
 
+/* Walls for entry k of an interleaved [x, y, x, y, ...] array */
+static inline float wall_lo(int k) { return (k & 1) ? YMIN : XMIN; }
+static inline float wall_hi(int k) { return (k & 1) ? YMAX : XMAX; }
+
 void apply_reflect(int n, float* restrict x, 
                    float* restrict v, float* restrict a)
 {
-    for (int i = 0; i < n; ++i, x += 2, v += 2, a += 2) {
-        if (x[0] < XMIN) reflect(XMIN, x+0, v+0, a+0);
-        if (x[0] > XMAX) reflect(XMAX, x+0, v+0, a+0);
-        if (x[1] < YMIN) reflect(YMIN, x+1, v+1, a+1);
-        if (x[1] > YMAX) reflect(YMAX, x+1, v+1, a+1);
+    for (int k = 0; k < 2*n; ++k) {
+        float s;
+        x[k] = reflect(x[k], wall_lo(k), wall_hi(k), &s);
+        v[k] *= s;
+        a[k] *= s;
+    }
+}
+
+/*@T
+ * \section{Fused integrator kernels}
+ *
+ * Once the force loop is $O(n)$, the passes over $x$, $v$ and $a$ in
+ * [[leapfrog1]], [[apply_reflect]] and [[leapfrog2]] are a visible
+ * part of a step: each one streams the arrays through the cache on
+ * its own, and the reflection tests are branches that a hot gas
+ * mispredicts often enough to matter.  So [[reflect]] above computes
+ * the reflected position along with the old one and selects between
+ * them, returning the sign to apply to $v$ and $a$; the two walls are
+ * tested in turn, as the old branches did.  With no branches left and
+ * the loops running over the interleaved arrays entry by entry, the
+ * compiler vectorizes them with compares and blends.
+ *
+ * The drivers call two fused kernels instead of the three loops.
+ * [[leapfrog_start]] is [[leapfrog1]] followed by [[apply_reflect]]
+ * in a single pass.  [[leapfrog_step]] also finishes the step before:
+ * the second half-kick of step $k$ and the first of step $k+1$ use
+ * the same acceleration, so the drivers can put off [[leapfrog2]]
+ * until the next step starts, and touch each particle once per step
+ * outside the force loop.  The operations are the same ones in the
+ * same order, so the trajectory is the same to the bit.  Anything
+ * that needs the velocities at a whole step (a checkpoint, a
+ * diagnostic sample, the end of the run) calls [[leapfrog2]] first.
+ *@c*/
+static inline void leapfrog_pass(int n, float dt, float* restrict x,
+                                 float* restrict v, float* restrict a,
+                                 const int finish)
+{
+    for (int k = 0; k < 2*n; ++k) {
+        float s;
+        float vk = v[k];
+        if (finish)
+            vk += a[k]*dt/2;
+        vk += a[k]*dt/2;
+        x[k] = reflect(x[k] + vk*dt, wall_lo(k), wall_hi(k), &s);
+        v[k] = s*vk;
+        a[k] = s*a[k];
     }
 }
 
+void leapfrog_start(int n, float dt, float* restrict x,
+                    float* restrict v, float* restrict a)
+{
+    leapfrog_pass(n, dt, x, v, a, 0);
+}
+
+void leapfrog_step(int n, float dt, float* restrict x,
+                   float* restrict v, float* restrict a)
+{
+    leapfrog_pass(n, dt, x, v, a, 1);
+}
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+
+
+/*@T
+ * \section{Diagnostics}
+ *
+ * Leapfrog should conserve energy up to a bounded oscillation, and
+ * momentum only changes at the walls; watching both is the quickest
+ * way to tell a sound run from one with too large a time step or a
+ * broken force kernel.  With [[-D k]], every $k$ steps the drivers
+ * add a line to [[<output>.diag]] with the step, the time, the kinetic
+ * energy, the Lennard-Jones and gravitational potential energies, the
+ * total, the momentum and the temperature.  The particles have unit
+ * mass and two degrees of freedom each, so (with $k_B = 1$) the
+ * temperature is the kinetic energy per particle.
+ *
+ * The expensive part is the pair potential, which is a sum over the
+ * same pairs the force loop visits.  So rather than a second pass,
+ * the force kernels take a [[double* pe]]: when it is [[NULL]] they
+ * do exactly what they did before, and otherwise they also add the
+ * potential of every pair they see into [[*pe]].  The rest is $O(n)$
+ * and happens only on sampled steps, so with [[-D 0]] (the default)
+ * the diagnostics cost one predictable branch per pair loop, and a
+ * sample costs roughly one slower force evaluation.  The force is cut
+ * off at $r_c$, so the energy it conserves is that of the shifted
+ * potential (see [[potential_LJ_cut]]).
+ *
+ * The step numbers run over the whole run: step 0 is the initial
+ * state, and the last step of frame $f$ is $f$ times the steps per
+ * frame.  [[diag_due]] returns the pointer to hand to the force
+ * kernel, zeroed, on the steps that get a sample, and [[NULL]] on
+ * the others.
+ *@c*/
+double* diag_due(diag_t* d, long step)
+{
+    if (d->every <= 0 || step % d->every != 0)
+        return NULL;
+    d->pe = 0;
+    return &d->pe;
+}
+
+void diag_sums(int n, const float* restrict x, const float* restrict v,
+               double pe, double* s)
+{
+    double ke = 0, px = 0, py = 0, sumy = 0;
+    for (int i = 0; i < n; ++i) {
+        ke   += v[2*i+0]*v[2*i+0] + v[2*i+1]*v[2*i+1];
+        px   += v[2*i+0];
+        py   += v[2*i+1];
+        sumy += x[2*i+1];
+    }
+    s[DIAG_KE]   = 0.5*ke;
+    s[DIAG_PX]   = px;
+    s[DIAG_PY]   = py;
+    s[DIAG_SUMY] = sumy;
+    s[DIAG_PE]   = pe;
+}
+
+/*@T
+ *
+ * The sums are per particle so that [[nbmpi]] can add them up over
+ * ranks and give the totals to rank 0, the only [[writer]].  The
+ * file is plain text, one sample per line under a one-line header,
+ * which is compact enough at one line per $k$ steps and goes straight
+ * into gnuplot.
+ *@c*/
+void diag_write(diag_t* d, const sim_param_t* params, long step,
+                const double* s)
+{
+    double ke = s[DIAG_KE];
+    double pe = s[DIAG_PE];
+    double pg = params->G * s[DIAG_SUMY];
+
+    if (!d->fp)
+        return;
+    fprintf(d->fp, "%ld %.6g %.9e %.9e %.9e %.9e %.6e %.6e %.6g\n",
+            step, step*(double) params->dt, ke, pe, pg, ke+pe+pg,
+            s[DIAG_PX], s[DIAG_PY], ke/params->npart);
+}
+
+void diag_sync(diag_t* d)
+{
+    if (d->fp)
+        fflush(d->fp);
+}
+
+void diag_close(diag_t* d)
+{
+    if (d->fp)
+        fclose(d->fp);
+    d->fp = NULL;
+}
+
+/*@T
+ *
+ * A run resumed from a checkpoint at step [[step0]] keeps the
+ * samples up to that step and drops any the killed run wrote after
+ * it, the same way the trajectory is cut back to the checkpointed
+ * frame; the resumed run then writes the rest.
+ *@c*/
+#define DIAG_HEADER "# step t KE PE_LJ PE_grav E px py T\n"
+
+static FILE* diag_reopen(const char* fname, long step0)
+{
+    char line[256];
+    char* tmp = (char*) malloc(strlen(fname)+5);
+    FILE* in = fopen(fname, "r");
+    FILE* out;
+
+    sprintf(tmp, "%s.tmp", fname);
+    out = fopen(tmp, "w");
+    if (!out) {
+        if (in)
+            fclose(in);
+        free(tmp);
+        return NULL;
+    }
+    fputs(DIAG_HEADER, out);
+    while (in && fgets(line, sizeof(line), in))
+        if (line[0] != '#' && atol(line) <= step0)
+            fputs(line, out);
+    if (in)
+        fclose(in);
+    fclose(out);
+    rename(tmp, fname);
+    free(tmp);
+    return fopen(fname, "a");
+}
+
+int diag_open(diag_t* d, const sim_param_t* params, long step0, int writer)
+{
+    d->fp    = NULL;
+    d->every = params->ndiag;
+    d->pe    = 0;
+    if (d->every <= 0 || !writer)
+        return 0;
+
+    if (step0 > 0) {
+        d->fp = diag_reopen(params->diag, step0);
+    } else {
+        d->fp = fopen(params->diag, "w");
+        if (d->fp)
+            fputs(DIAG_HEADER, d->fp);
+    }
+    if (!d->fp) {
+        fprintf(stderr, "Could not open diagnostics %s\n", params->diag);
+        return -1;
+    }
+    return 0;
+}
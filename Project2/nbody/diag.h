@@ -0,0 +1,32 @@
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <stdio.h>
+
+#include "params.h"
+
+/* Sums over particles that make up one sample; ranks add them up */
+#define DIAG_KE   0   /* Kinetic energy                     */
+#define DIAG_PX   1   /* Momentum                           */
+#define DIAG_PY   2
+#define DIAG_SUMY 3   /* Sum of heights (gravity potential) */
+#define DIAG_PE   4   /* Lennard-Jones potential energy     */
+#define DIAG_NSUM 5
+
+typedef struct diag_t {
+    FILE*  fp;      /* Time series, or NULL on ranks that do not write */
+    int    every;   /* Steps between samples, 0 for none               */
+    double pe;      /* Pair potential summed by the force loop         */
+} diag_t;
+
+int     diag_open(diag_t* d, const sim_param_t* params, long step0,
+                  int writer);
+double* diag_due(diag_t* d, long step);
+void    diag_sums(int n, const float* restrict x, const float* restrict v,
+                  double pe, double* s);
+void    diag_write(diag_t* d, const sim_param_t* params, long step,
+                   const double* s);
+void    diag_sync(diag_t* d);
+void    diag_close(diag_t* d);
+
+#endif /* DIAG_H */
@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_writer.h"
+#include "nbody_io.h"
+
+
+/*@T
+ * \section{Background output}
+ *
+ * With a big enough system, writing a frame takes about as long as
+ * the [[npframe]] steps that produce it, and the time steps sit idle
+ * while it happens.  The output does not have to be synchronous,
+ * though: once a frame is copied somewhere safe, the integrator can
+ * go on moving the particles.  So we keep a small ring of frame
+ * buffers and a writer thread that drains it.  The integrator copies
+ * the positions into the next free slot with [[frame_writer_push]]
+ * and carries on; the writer calls [[write_frame_data]] on each
+ * queued slot in order.  The writer also owns the file format:
+ * [[NBView01]] from [[write_frame_data]], or the compressed
+ * [[NBView02]] when [[qbits]] is set, in which case the frame index
+ * goes out after the last frame.
+ *
+ * If the disk falls behind by more than [[nbuf]] frames, the ring
+ * is full and [[frame_writer_push]] waits for a slot to free up.
+ * That back-pressure keeps the memory bounded, and we count the time
+ * spent waiting so that a slow disk shows up in the run summary
+ * instead of being mistaken for slow force code.
+ *@c*/
+static double wall_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static void* frame_writer_main(void* arg)
+{
+    frame_writer_t* fw = (frame_writer_t*) arg;
+    pthread_mutex_lock(&fw->lock);
+    for (;;) {
+        while (fw->count == 0 && !fw->done)
+            pthread_cond_wait(&fw->ready, &fw->lock);
+        if (fw->count == 0)
+            break;
+
+        /* The slot stays ours until count drops, so write unlocked */
+        float* x = fw->buf[fw->head];
+        pthread_mutex_unlock(&fw->lock);
+        if (fw->qbits)
+            traj_write_frame(&fw->traj, x);
+        else
+            write_frame_data(fw->fp, fw->n, x);
+        pthread_mutex_lock(&fw->lock);
+
+        fw->head = (fw->head + 1) % fw->nbuf;
+        --fw->count;
+        pthread_cond_signal(&fw->space);
+    }
+    pthread_mutex_unlock(&fw->lock);
+    return NULL;
+}
+
+void frame_writer_init(frame_writer_t* fw, FILE* fp, int n, int nbuf,
+                       int qbits, int append)
+{
+    fw->fp      = fp;
+    fw->n       = n;
+    fw->qbits   = qbits;
+    if (qbits)
+        traj_write_header(&fw->traj, fp, n, qbits);
+    else if (!append)
+        write_header(fp, n);
+    fw->nbuf    = nbuf;
+    fw->buf     = (float**) malloc(nbuf*sizeof(float*));
+    for (int k = 0; k < nbuf; ++k)
+        fw->buf[k] = (float*) malloc(2*n*sizeof(float));
+    fw->head    = 0;
+    fw->count   = 0;
+    fw->done    = 0;
+    fw->nframes = 0;
+    fw->nstall  = 0;
+    fw->stall   = 0;
+    pthread_mutex_init(&fw->lock, NULL);
+    pthread_cond_init(&fw->ready, NULL);
+    pthread_cond_init(&fw->space, NULL);
+    pthread_create(&fw->thread, NULL, frame_writer_main, fw);
+}
+
+/*@T
+ *
+ * Only the integrator fills slots, so once it sees a free one it can
+ * copy into it without holding the lock; the writer never touches a
+ * slot until [[count]] says it is queued.
+ *@c*/
+void frame_writer_push(frame_writer_t* fw, const float* x)
+{
+    pthread_mutex_lock(&fw->lock);
+    if (fw->count == fw->nbuf) {
+        double t0 = wall_time();
+        while (fw->count == fw->nbuf)
+            pthread_cond_wait(&fw->space, &fw->lock);
+        fw->stall += wall_time()-t0;
+        ++fw->nstall;
+    }
+    int slot = (fw->head + fw->count) % fw->nbuf;
+    pthread_mutex_unlock(&fw->lock);
+
+    memcpy(fw->buf[slot], x, 2*fw->n*sizeof(float));
+
+    pthread_mutex_lock(&fw->lock);
+    ++fw->count;
+    ++fw->nframes;
+    pthread_cond_signal(&fw->ready);
+    pthread_mutex_unlock(&fw->lock);
+}
+
+/*@T
+ *
+ * Before a checkpoint, the frames it refers to must really be in the
+ * file, so [[frame_writer_sync]] waits for the ring to drain and
+ * flushes the stream.  Time spent here counts as stall time too.
+ *@c*/
+void frame_writer_sync(frame_writer_t* fw)
+{
+    double t0 = wall_time();
+    pthread_mutex_lock(&fw->lock);
+    while (fw->count > 0)
+        pthread_cond_wait(&fw->space, &fw->lock);
+    fflush(fw->fp);
+    pthread_mutex_unlock(&fw->lock);
+    fw->stall += wall_time()-t0;
+}
+
+/*@T
+ *
+ * Shutting down waits for the queued frames to reach the file, so
+ * the caller can close it as soon as [[frame_writer_free]] returns.
+ * The stall counters are still valid at that point, and the caller
+ * reads them out for its summary.
+ *@c*/
+void frame_writer_free(frame_writer_t* fw)
+{
+    pthread_mutex_lock(&fw->lock);
+    fw->done = 1;
+    pthread_cond_signal(&fw->ready);
+    pthread_mutex_unlock(&fw->lock);
+    pthread_join(fw->thread, NULL);
+    if (fw->qbits)
+        traj_write_index(&fw->traj);
+
+    pthread_cond_destroy(&fw->space);
+    pthread_cond_destroy(&fw->ready);
+    pthread_mutex_destroy(&fw->lock);
+    for (int k = 0; k < fw->nbuf; ++k)
+        free(fw->buf[k]);
+    free(fw->buf);
+}
@@ -0,0 +1,37 @@
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "traj.h"
+
+/* Frames waiting for the writer are buf[head] onward, count of them */
+typedef struct frame_writer_t {
+    FILE*           fp;         /* Output file                          */
+    int             n;          /* Particles per frame                  */
+    int             qbits;      /* Bits per coordinate, 0 for NBView01  */
+    traj_writer_t   traj;       /* Encoder state when qbits > 0         */
+    int             nbuf;       /* Slots in the ring                    */
+    float**         buf;        /* Ring of frame buffers (2n each)      */
+    int             head;       /* Oldest frame not yet written         */
+    int             count;      /* Frames queued                        */
+    int             done;       /* No more frames will be queued        */
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;      /* A frame was queued (or done set)     */
+    pthread_cond_t  space;      /* A slot was freed                     */
+    pthread_t       thread;
+    int             nframes;    /* Frames queued so far                 */
+    int             nstall;     /* Times the ring was full              */
+    double          stall;      /* Seconds spent waiting on a full ring */
+} frame_writer_t;
+
+#define FRAME_NBUF 4
+
+void frame_writer_init(frame_writer_t* fw, FILE* fp, int n, int nbuf,
+                       int qbits, int append);
+void frame_writer_push(frame_writer_t* fw, const float* x);
+void frame_writer_sync(frame_writer_t* fw);
+void frame_writer_free(frame_writer_t* fw);
+
+#endif /* FRAME_WRITER_H */
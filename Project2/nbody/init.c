@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+#include "philox.h"
+#include "common.h"
+#include "init.h"
+
+
+/*@T
+ * \section{Initial conditions}
+ *
+ * The drivers start from particles placed uniformly at random, subject
+ * to the constraint that no two particles are closer than the basic
+ * interaction radius $\sigma$ of Lennard-Jones, lest the simulation
+ * blow up on the first time steps.  The obvious way to do this checks
+ * each trial point against every particle placed so far, which is
+ * $O(n^2)$ per trial; at a million particles that takes far longer
+ * than the run it sets up.
+ *
+ * Instead we keep an occupancy grid of cells at least $\sigma$ on a
+ * side, with the particles in each cell on a linked list as they are
+ * placed.  A trial point can only be too close to particles in its
+ * own cell and the eight around it, so a trial is $O(1)$ and placing
+ * all the particles is $O(n)$.  We never use more cells than
+ * particles, so the grid is $O(n)$ too even when $\sigma$ is small.
+ *
+ * If it takes [[INIT_TRIALS]] trials in a row to place a particle, the
+ * box is as full as random placement will make it; we keep what we
+ * have and the caller runs with fewer particles.
+ *@c*/
+#define INIT_TRIALS 1000
+
+/*@T
+ *
+ * To place particles in parallel we split the box into strips of two
+ * or three grid columns, and fill the strips in two phases: first the
+ * even strips, then the odd ones.  A strip's particles only look at
+ * the columns next to it, which belong to strips of the other phase,
+ * so strips in the same phase never touch each other's cells.  Strip
+ * $k$ covers columns [[c0]] to [[c1-1]], and gets a share of the
+ * particles in proportion to its width, so that a three-column strip
+ * is filled as densely as a two-column one.  Each strip has its own
+ * Philox stream (see [[philox.h]]), so the result does not depend on
+ * which thread or rank fills which strip.  The streams for the strips,
+ * the lattice and the velocities are kept apart by the high word of
+ * the stream number.
+ *@c*/
+#define STREAM_STRIP    (1ULL << 32)
+#define STREAM_LATTICE  (2ULL << 32)
+#define STREAM_VELOCITY (3ULL << 32)
+
+static void strip_columns(const init_grid_t* g, int k, int* c0, int* c1)
+{
+    *c0 = (int) ((long) k     * g->nx / g->nstrips);
+    *c1 = (int) ((long) (k+1) * g->nx / g->nstrips);
+}
+
+void init_grid_setup(init_grid_t* g, int n, float sig, long seed)
+{
+    int m = (int) ceil(sqrt((double) n));
+
+    g->n    = n;
+    g->sig2 = sig*sig;
+    g->seed = seed;
+    g->nx   = (int) ((XMAX-XMIN)/sig);
+    g->ny   = (int) ((YMAX-YMIN)/sig);
+    if (g->nx > m) g->nx = m;
+    if (g->ny > m) g->ny = m;
+    if (g->nx < 1) g->nx = 1;
+    if (g->ny < 1) g->ny = 1;
+    g->hx = (XMAX-XMIN)/g->nx;
+    g->hy = (YMAX-YMIN)/g->ny;
+
+    g->nstrips = (g->nx > 1) ? g->nx/2 : 1;
+    g->first = (int*) malloc((g->nstrips+1) * sizeof(int));
+    g->count = (int*) calloc(g->nstrips, sizeof(int));
+    for (int k = 0; k < g->nstrips; ++k) {
+        int c0, c1;
+        strip_columns(g, k, &c0, &c1);
+        g->first[k] = (int) ((long) c0*n / g->nx);
+    }
+    g->first[g->nstrips] = n;
+
+    g->head = (int*) malloc(g->nx*g->ny * sizeof(int));
+    g->next = (int*) malloc(n * sizeof(int));
+    for (int c = 0; c < g->nx*g->ny; ++c)
+        g->head[c] = -1;
+}
+
+void init_grid_free(init_grid_t* g)
+{
+    free(g->next);
+    free(g->head);
+    free(g->count);
+    free(g->first);
+}
+
+/*@T
+ *
+ * Rounding can put a point on the edge of a strip into the column
+ * next door, so we clamp the column to the strip; that keeps each
+ * strip's writes to its own cells, and costs at most a rounding error
+ * in the distance check.
+ *@c*/
+static int grid_cell(const init_grid_t* g, int c0, int c1, const float* x)
+{
+    int ix = (int) ((x[0]-XMIN)/g->hx);
+    int iy = (int) ((x[1]-YMIN)/g->hy);
+    if (ix < c0)     ix = c0;
+    if (ix >= c1)    ix = c1-1;
+    if (iy < 0)      iy = 0;
+    if (iy >= g->ny) iy = g->ny-1;
+    return iy*g->nx + ix;
+}
+
+static int grid_clear(const init_grid_t* g, int c, const float* x, int i)
+{
+    int ix = c % g->nx;
+    int iy = c / g->nx;
+    int jx0 = (ix > 0) ? ix-1 : 0, jx1 = (ix+1 < g->nx) ? ix+1 : ix;
+    int jy0 = (iy > 0) ? iy-1 : 0, jy1 = (iy+1 < g->ny) ? iy+1 : iy;
+
+    for (int jy = jy0; jy <= jy1; ++jy)
+        for (int jx = jx0; jx <= jx1; ++jx)
+            for (int j = g->head[jy*g->nx+jx]; j >= 0; j = g->next[j]) {
+                float dx = x[2*i+0]-x[2*j+0];
+                float dy = x[2*i+1]-x[2*j+1];
+                if (dx*dx + dy*dy < g->sig2)
+                    return 0;
+            }
+    return 1;
+}
+
+int init_grid_strip(init_grid_t* g, int k, float* x)
+{
+    philox_stream_t s;
+    int c0, c1, i;
+    int nk = g->first[k+1]-g->first[k];
+
+    strip_columns(g, k, &c0, &c1);
+    double x0 = XMIN + c0*g->hx;
+    double w  = (c1-c0)*g->hx;
+
+    philox_stream_init(&s, g->seed, STREAM_STRIP + k);
+    for (i = 0; i < nk; ++i) {
+        int j = g->first[k]+i;
+        int c = 0;
+        int ok = 0;
+        for (int trial = 0; !ok && trial < INIT_TRIALS; ++trial) {
+            x[2*j+0] = (float) (x0 + w*philox_next_u01(&s));
+            x[2*j+1] = (float) (YMIN + (YMAX-YMIN)*philox_next_u01(&s));
+            c  = grid_cell(g, c0, c1, x+2*j);
+            ok = grid_clear(g, c, x, j);
+        }
+        if (!ok)
+            break;
+        g->next[j] = g->head[c];
+        g->head[c] = j;
+    }
+    g->count[k] = i;
+    return i;
+}
+
+/*@T
+ *
+ * When strips are filled on different ranks, each rank needs the
+ * other ranks' even strips in its grid before it fills the odd ones;
+ * [[init_grid_insert]] adds a strip placed elsewhere.  Once all strips
+ * are filled, [[init_grid_pack]] closes up the gaps left by strips
+ * that came up short, and returns the number of particles placed.
+ *@c*/
+void init_grid_insert(init_grid_t* g, int k, const float* x)
+{
+    int c0, c1;
+    strip_columns(g, k, &c0, &c1);
+    for (int j = g->first[k]; j < g->first[k]+g->count[k]; ++j) {
+        int c = grid_cell(g, c0, c1, x+2*j);
+        g->next[j] = g->head[c];
+        g->head[c] = j;
+    }
+}
+
+int init_grid_pack(init_grid_t* g, float* x)
+{
+    int n = 0;
+    for (int k = 0; k < g->nstrips; ++k) {
+        memmove(x+2*n, x+2*g->first[k], 2*g->count[k]*sizeof(float));
+        n += g->count[k];
+    }
+    return n;
+}
+
+int init_particles_grid(int n, float* x, float sig, long seed)
+{
+    init_grid_t g;
+    init_grid_setup(&g, n, sig, seed);
+    for (int phase = 0; phase < 2; ++phase) {
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic)
+#endif
+        for (int k = phase; k < g.nstrips; k += 2)
+            init_grid_strip(&g, k, x);
+    }
+    n = init_grid_pack(&g, x);
+    init_grid_free(&g);
+    return n;
+}
+
+/*@T
+ *
+ * The lattice initialiser ([[-i lattice]]) puts the particles on a
+ * square lattice, filled a row at a time from the bottom, and moves
+ * each one by a random amount small enough that neighbours stay at
+ * least $\sigma$ apart: with spacing $h$, up to $(h-\sigma)/2$ in each
+ * direction.  It needs no checks at all, and packs the box to one
+ * particle per $\sigma^2$ where random placement jams at about half
+ * that; the price is that the start is far from a typical state of
+ * the gas.  Each particle's jitter comes straight from its own
+ * element of the lattice stream.
+ *@c*/
+int init_particles_lattice(int n, float* x, float sig, long seed)
+{
+    int m    = (int) ceil(sqrt((double) n));
+    int mmax = (int) ((XMAX-XMIN)/sig);
+    if (mmax < 1)
+        mmax = 1;
+    if (m > mmax) {
+        m = mmax;
+        if (n > m*m)
+            n = m*m;
+    }
+
+    double hx = (XMAX-XMIN)/m, jx = (hx > sig) ? (hx-sig)/2 : 0;
+    double hy = (YMAX-YMIN)/m, jy = (hy > sig) ? (hy-sig)/2 : 0;
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < n; ++i) {
+        philox4x32_t r = philox4x32(seed, STREAM_LATTICE, i);
+        int row = i/m, col = i%m;
+        x[2*i+0] = (float) (XMIN + (col+0.5)*hx +
+                            jx*(2*philox_u01(r.v[0], r.v[1])-1));
+        x[2*i+1] = (float) (YMIN + (row+0.5)*hy +
+                            jy*(2*philox_u01(r.v[2], r.v[3])-1));
+    }
+    return n;
+}
+
+/*@T
+ *
+ * The drivers call [[init_positions]], which picks the layout named
+ * by [[-i]] and seeds it with [[-S]].  The velocity components are
+ * normal with mean zero and variance $T_0^2$, by Box-Muller from the
+ * four words of particle $i$'s element; [[init_velocities]] fills in
+ * particles [[first]] to [[first+n-1]], so each rank of [[nbmpi]] can
+ * make just its own.
+ *@c*/
+int init_positions(int n, float* x, sim_param_t* params)
+{
+    if (strcmp(params->init, "lattice") == 0)
+        return init_particles_lattice(n, x, params->sig_lj, params->seed);
+    return init_particles_grid(n, x, params->sig_lj, params->seed);
+}
+
+void init_velocities(int first, int n, float* v, sim_param_t* params)
+{
+    float T0 = params->T0;
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < n; ++i) {
+        philox4x32_t r = philox4x32(params->seed, STREAM_VELOCITY, first+i);
+        double R = T0 * sqrt(-2*log(1-philox_u01(r.v[0], r.v[1])));
+        double T = 2*M_PI*philox_u01(r.v[2], r.v[3]);
+        v[2*i+0] = (float) (R * cos(T));
+        v[2*i+1] = (float) (R * sin(T));
+    }
+}
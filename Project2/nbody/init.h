@@ -0,0 +1,33 @@
+#ifndef INIT_H
+#define INIT_H
+
+#include "params.h"
+
+/* Occupancy grid for placing particles at least sigma apart.  Slots
+ * first[k] to first[k+1]-1 of x belong to strip k, of which the first
+ * count[k] have been placed. */
+typedef struct init_grid_t {
+    int    n;        /* Particles wanted                      */
+    int    nx, ny;   /* Number of cells in each direction     */
+    float  hx, hy;   /* Cell dimensions (>= sigma)            */
+    float  sig2;     /* Squared minimum distance              */
+    long   seed;     /* Philox key of the strip streams       */
+    int    nstrips;  /* Column strips the box is split into   */
+    int*   first;    /* First slot of each strip (nstrips+1)  */
+    int*   count;    /* Particles placed in each strip        */
+    int*   head;     /* First particle in each cell, or -1    */
+    int*   next;     /* Next particle in the same cell        */
+} init_grid_t;
+
+void init_grid_setup(init_grid_t* g, int n, float sig, long seed);
+void init_grid_free(init_grid_t* g);
+int  init_grid_strip(init_grid_t* g, int k, float* x);
+void init_grid_insert(init_grid_t* g, int k, const float* x);
+int  init_grid_pack(init_grid_t* g, float* x);
+
+int  init_particles_grid(int n, float* x, float sig, long seed);
+int  init_particles_lattice(int n, float* x, float sig, long seed);
+int  init_positions(int n, float* x, sim_param_t* params);
+void init_velocities(int first, int n, float* v, sim_param_t* params);
+
+#endif /* INIT_H */
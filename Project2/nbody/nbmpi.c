@@ -5,7 +5,11 @@
 #include <mpi.h>
 
 #include "common.h"
+#include "cells.h"
 #include "nbody_io.h"
+#include "checkpoint.h"
+#include "diag.h"
+#include "init.h"
 #include "params.h"
 
 /*@T
@@ -65,86 +69,100 @@ void partition_problem(int* iparts, int* counts, int npart)
  * re-using computations, this looks much the same as (though not identical
  * to) the serial code.
  *@c*/
-void compute_forces(int n, const float* restrict x, 
-                    int istart, int iend, 
-                    const float* restrict xlocal, float* restrict Flocal,
-                    sim_param_t* params)
+static void external_forces(int nlocal, float* restrict Flocal,
+                            sim_param_t* params)
 {
-    int nlocal = iend-istart;
-    float g    = params->G;
-    float eps  = params->eps_lj;
-    float sig  = params->sig_lj;
-    float sig2 = sig*sig;
+    float g = params->G;
 
     /* Global force downward (e.g. gravity) */
     for (int i = 0; i < nlocal; ++i) {
         Flocal[2*i+0] = 0;
         Flocal[2*i+1] = -g;
     }
+}
+
+/* Add the pull of particles jstart <= j < jend (positions xj) on the
+   local particles istart <= i < iend.  Every pair is seen from both
+   ends, so with pe set each sighting adds half the pair's energy. */
+static void block_forces(int istart, int iend,
+                         const float* restrict xlocal, float* restrict Flocal,
+                         int jstart, int jend, const float* restrict xj,
+                         sim_param_t* params, double* pe)
+{
+    float eps  = params->eps_lj;
+    float sig  = params->sig_lj;
+    float sig2 = sig*sig;
+    double u = 0;
 
     /* Particle-particle interactions (Lennard-Jones) */
     for (int i = istart; i < iend; ++i) {
         int ii = i-istart;
-        for (int j = 0; j < n; ++j) {
+        for (int j = jstart; j < jend; ++j) {
             if (i != j) {
-                float dx = x[2*j+0]-xlocal[2*ii+0];
-                float dy = x[2*j+1]-xlocal[2*ii+1];
-                float C_LJ = compute_LJ_scalar(dx*dx+dy*dy, eps, sig2);
+                int jj = j-jstart;
+                float dx = xj[2*jj+0]-xlocal[2*ii+0];
+                float dy = xj[2*jj+1]-xlocal[2*ii+1];
+                float r2 = dx*dx+dy*dy;
+                float C_LJ = compute_LJ_scalar(r2, eps, sig2);
                 Flocal[2*ii+0] += (C_LJ*dx);
                 Flocal[2*ii+1] += (C_LJ*dy);
+                if (pe)
+                    u += potential_LJ_cut(r2, eps, sig2);
             }
         }
     }
+    if (pe)
+        *pe += 0.5*u;
+}
+
+void compute_forces(int n, const float* restrict x, 
+                    int istart, int iend, 
+                    const float* restrict xlocal, float* restrict Flocal,
+                    sim_param_t* params, double* pe)
+{
+    external_forces(iend-istart, Flocal, params);
+    block_forces(istart, iend, xlocal, Flocal, 0, n, x, params, pe);
 }
 
 /*@T
  * \subsection{Initial conditions}
  *
  * Previously, we chose the particles and their velocities simultaneously.
- * Now, it doesn't make sense to do so.  I know how to generate a random
- * initial particle distribution by rejection on a single node given
- * all the point coordinates, but I don't need to do this for the velocities.
+ * Now, it doesn't make sense to do so.  Every rank needs all the
+ * initial positions, but only its own velocities, which it makes
+ * directly from the particle numbers (see [[init_velocities]]).
+ *
+ * The positions come from the strip-by-strip placement in [[init.c]],
+ * with the strips of each phase dealt out to the ranks in turn.  After
+ * each phase every strip is broadcast from the rank that filled it;
+ * after the even phase, each rank also adds the strips it did not
+ * fill to its grid, so the odd strips see their neighbours.  Each strip
+ * has its own random stream, so the layout is the one [[nbserial]]
+ * gets from the same seed, whatever the number of ranks.
  *@c*/
 int init_particles_random(int n, float* x, sim_param_t* params)
 {
-    const int MAX_INIT_TRIALS = 1000;
-
-    float sig    = params->sig_lj;
-    float min_r2 = sig*sig;
-
-    for (int i = 0; i < n; ++i) {
-        float r2 = 0;
-
-        /* Choose new point via rejection sampling */
-        for (int trial = 0; r2 < min_r2 && trial < MAX_INIT_TRIALS; ++trial) {
-            x[2*i+0] = (float) drand48();
-            x[2*i+1] = (float) drand48();
-            for (int j = 0; j < i; ++j) {
-                float dx = x[2*i+0]-x[2*j+0];
-                float dy = x[2*i+1]-x[2*j+1];
-                r2 = dx*dx + dy*dy;
-                if (r2 < min_r2)
-                    break;
-            }
-        }
+    init_grid_t g;
 
-        /* If it takes too many trials, bail and declare victory! */
-        if (i > 0 && r2 < min_r2) 
-            return i;
-    }
-    return n;
-}
+    if (strcmp(params->init, "lattice") == 0)
+        return init_particles_lattice(n, x, params->sig_lj, params->seed);
 
-
-void init_particles_random_v(int n, float* v, sim_param_t* params)
-{
-    float T0 = params->T0;
-    for (int i = 0; i < n; ++i) {
-        double R = T0 * sqrt(-2*log(drand48()));
-        double T = 2*M_PI*drand48();
-        v[2*i+0] = (float) (R * cos(T));
-        v[2*i+1] = (float) (R * sin(T));
+    init_grid_setup(&g, n, params->sig_lj, params->seed);
+    for (int phase = 0; phase < 2; ++phase) {
+        for (int k = phase + 2*rank; k < g.nstrips; k += 2*nproc)
+            init_grid_strip(&g, k, x);
+        for (int k = phase; k < g.nstrips; k += 2) {
+            int owner = (k/2) % nproc;
+            MPI_Bcast(g.count+k, 1, MPI_INT, owner, MPI_COMM_WORLD);
+            MPI_Bcast(x+2*g.first[k], g.count[k], pairtype, owner,
+                      MPI_COMM_WORLD);
+            if (phase == 0 && owner != rank)
+                init_grid_insert(&g, k, x);
+        }
     }
+    n = init_grid_pack(&g, x);
+    init_grid_free(&g);
+    return n;
 }
 
 /*@T
@@ -157,47 +175,750 @@ void init_particles_random_v(int n, float* v, sim_param_t* params)
  * had nonblocking collective operations, this would have been
  * a perfect place to use them.
  *
- * Note that we output whenever the output file [[fp]] is
- * non-[[NULL]].
+ * MPI-3 does have them, so [[-m overlap]] starts an
+ * [[MPI_Iallgatherv]] instead and computes the interactions among the
+ * local particles, which need nothing from anybody else, while the
+ * positions are in flight.  Only the interactions with the other
+ * ranks' particles wait for the exchange to finish.
+ *
+ * With [[-m ring]] the positions travel around a ring of ranks
+ * instead: at stage $s$ every rank holds the block of rank
+ * $r-s \bmod p$, passes it on to the right with [[MPI_Isend]],
+ * receives the next one from the left with [[MPI_Irecv]], and
+ * computes with the block it holds while the transfer goes on.  Each
+ * remote contribution is applied as soon as its block arrives, and
+ * each transfer is only $n/p$ positions.  The ring does not keep the
+ * global position array up to date, which is fine, since every rank
+ * writes its own particles to the output file.
+ *
+ * Whatever the mode, we time the force computation and the time
+ * spent blocked in MPI, and report both at the end; with good
+ * overlap the second is small.
  *@c*/
-void run_box(FILE* fp,                  /* Output file (at 0) */
+static double t_compute;   /* Seconds in force computation  */
+static double t_wait;      /* Seconds blocked in the exchange */
+
+static void exchange_overlap(int n, float* restrict x, int nlocal,
+                             int* iparts, int* counts,
+                             const float* restrict xlocal,
+                             float* restrict alocal, sim_param_t* params,
+                             double* pe)
+{
+    MPI_Request req;
+    double t0 = MPI_Wtime();
+
+    MPI_Iallgatherv(xlocal, nlocal, pairtype,
+                    x, counts, iparts, pairtype,
+                    MPI_COMM_WORLD, &req);
+
+    double t1 = MPI_Wtime();
+    external_forces(nlocal, alocal, params);
+    block_forces(iparts[rank], iparts[rank+1], xlocal, alocal,
+                 iparts[rank], iparts[rank+1], xlocal, params, pe);
+    double t2 = MPI_Wtime();
+
+    MPI_Wait(&req, MPI_STATUS_IGNORE);
+    double t3 = MPI_Wtime();
+
+    for (int r = 0; r < nproc; ++r)
+        if (r != rank)
+            block_forces(iparts[rank], iparts[rank+1], xlocal, alocal,
+                         iparts[r], iparts[r+1], x+2*iparts[r], params,
+                         pe);
+
+    t_wait    += (t1-t0) + (t3-t2);
+    t_compute += (t2-t1) + (MPI_Wtime()-t3);
+}
+
+static void exchange_ring(int nlocal, int* iparts, int* counts,
+                          const float* restrict xlocal,
+                          float* restrict alocal, float* buf[2],
+                          sim_param_t* params, double* pe)
+{
+    int left  = (rank+nproc-1) % nproc;
+    int right = (rank+1) % nproc;
+    int cur   = 0;
+
+    memcpy(buf[cur], xlocal, 2*nlocal*sizeof(float));
+    external_forces(nlocal, alocal, params);
+
+    for (int s = 0; s < nproc; ++s) {
+        MPI_Request req[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+        int owner = (rank+nproc-s) % nproc;
+        int next  = (owner+nproc-1) % nproc;
+        double t0 = MPI_Wtime();
+
+        if (s < nproc-1) {
+            MPI_Irecv(buf[1-cur], counts[next], pairtype, left, 0,
+                      MPI_COMM_WORLD, &req[0]);
+            MPI_Isend(buf[cur], counts[owner], pairtype, right, 0,
+                      MPI_COMM_WORLD, &req[1]);
+        }
+
+        double t1 = MPI_Wtime();
+        block_forces(iparts[rank], iparts[rank+1], xlocal, alocal,
+                     iparts[owner], iparts[owner+1], buf[cur], params, pe);
+        double t2 = MPI_Wtime();
+
+        MPI_Waitall(2, req, MPI_STATUSES_IGNORE);
+        t_wait    += (t1-t0) + (MPI_Wtime()-t2);
+        t_compute += (t2-t1);
+        cur = 1-cur;
+    }
+}
+
+/*@T
+ *
+ * On the steps that take a diagnostic sample (see [[diag.c]]) each
+ * rank has the potential energy of its own particles' pairs from the
+ * force loop, and sums the rest over its own particles; the ranks then
+ * add up their sums on rank 0, which writes the line.
+ *@c*/
+static void diag_sample(diag_t* d, sim_param_t* params, long step,
+                        int nlocal, const float* x, const float* v)
+{
+    double s[DIAG_NSUM], total[DIAG_NSUM];
+    diag_sums(nlocal, x, v, d->pe, s);
+    MPI_Reduce(s, total, DIAG_NSUM, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    diag_write(d, params, step, total);
+}
+
+/*@T
+ * \subsection{Parallel output}
+ *
+ * Funnelling every frame through rank 0 means rank 0 needs all the
+ * positions and spends time proportional to $n$ on each frame, however
+ * many ranks we have.  But the [[NBView01]] layout is so regular that
+ * every rank can work out where its particles go: after the header,
+ * frame $f$ starts $8 n f$ bytes in, and particle $i$ is 8 bytes
+ * further per index.  So rank 0 writes the header with the usual
+ * routine, and then all ranks open the file with MPI-IO and write
+ * their own slices with a collective call.
+ *
+ * The viewer wants big-endian floats.  MPI's [[external32]] data
+ * representation is exactly that, so we set the file view with it
+ * and let the library do the byte swapping.
+ *
+ * The write is nonblocking ([[MPI_File_iwrite_at_all]]) from a copy
+ * of the local positions, so the disk works while we take the next
+ * [[npframe]] steps; we only wait for a frame when it is time to
+ * start the next one.  That wait is the output stall we report.
+ *@c*/
+typedef struct frame_file_t {
+    MPI_File     fh;
+    MPI_Offset   hdr;     /* Bytes in the header                */
+    int          n;       /* Particles per frame                */
+    int          frame;   /* Index of the next frame            */
+    float*       buf;     /* Copy of the slice being written    */
+    int          nalloc;  /* Pairs buf can hold                 */
+    int*         disp;    /* Global indices (scattered writes)  */
+    MPI_Datatype ftype;   /* File type (scattered writes)       */
+    MPI_Request  req;     /* Outstanding write                  */
+    double       wait;    /* Seconds waiting for earlier writes */
+} frame_file_t;
+
+/* Open for frames first onward; a restart keeps frames 0..first-1 */
+static void frame_file_open(frame_file_t* ff, const char* fname, int n,
+                            int first)
+{
+    long hdr = 0;
+    if (rank == 0) {
+        FILE* fp;
+        if (first == 0) {
+            fp = fopen(fname, "w");
+            write_header(fp, n);
+            hdr = ftell(fp);
+        } else {
+            fp = ckpt_reopen_output(fname, n, first);
+            hdr = ftell(fp) - 8L*n*first;
+        }
+        fclose(fp);
+    }
+    MPI_Bcast(&hdr, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+    MPI_File_open(MPI_COMM_WORLD, (char*) fname, MPI_MODE_WRONLY,
+                  MPI_INFO_NULL, &ff->fh);
+    MPI_File_set_view(ff->fh, hdr, pairtype, pairtype, "external32",
+                      MPI_INFO_NULL);
+    ff->hdr    = hdr;
+    ff->n      = n;
+    ff->frame  = first;
+    ff->buf    = NULL;
+    ff->nalloc = 0;
+    ff->disp   = NULL;
+    ff->ftype  = MPI_DATATYPE_NULL;
+    ff->req    = MPI_REQUEST_NULL;
+    ff->wait   = 0;
+}
+
+/* Wait for the last frame and make room for nlocal pairs */
+static void frame_file_ready(frame_file_t* ff, int nlocal)
+{
+    double t0 = MPI_Wtime();
+    MPI_Wait(&ff->req, MPI_STATUS_IGNORE);
+    ff->wait += MPI_Wtime()-t0;
+    if (nlocal > ff->nalloc) {
+        ff->nalloc = nlocal;
+        ff->buf  = (float*) realloc(ff->buf, 2*nlocal*sizeof(float));
+        ff->disp = (int*) realloc(ff->disp, nlocal*sizeof(int));
+    }
+}
+
+/* Write particles first..first+nlocal-1 of the next frame */
+static void frame_file_write(frame_file_t* ff, int first, int nlocal,
+                             const float* xlocal)
+{
+    frame_file_ready(ff, nlocal);
+    memcpy(ff->buf, xlocal, 2*nlocal*sizeof(float));
+    MPI_File_iwrite_at_all(ff->fh, (MPI_Offset) ff->frame*ff->n + first,
+                           ff->buf, nlocal, pairtype, &ff->req);
+    ++ff->frame;
+}
+
+/*@T
+ *
+ * With the spatial decomposition a rank's particles are scattered
+ * through the frame.  We sort them by index and describe their slots
+ * with an indexed file type, which MPI requires to be increasing;
+ * the view then starts at the frame and one collective write fills
+ * in everybody's particles.
+ *@c*/
+static const int* sort_ids;
+
+static int compare_ids(const void* a, const void* b)
+{
+    return sort_ids[*(const int*) a] - sort_ids[*(const int*) b];
+}
+
+static void frame_file_write_ids(frame_file_t* ff, int nlocal,
+                                 const int* ids, const float* xlocal)
+{
+    int* perm = (int*) malloc((nlocal+1)*sizeof(int));
+    for (int k = 0; k < nlocal; ++k)
+        perm[k] = k;
+    sort_ids = ids;
+    qsort(perm, nlocal, sizeof(int), compare_ids);
+
+    frame_file_ready(ff, nlocal);
+    for (int k = 0; k < nlocal; ++k) {
+        ff->disp[k] = ids[perm[k]];
+        memcpy(ff->buf+2*k, xlocal+2*perm[k], 2*sizeof(float));
+    }
+    free(perm);
+
+    if (ff->ftype != MPI_DATATYPE_NULL)
+        MPI_Type_free(&ff->ftype);
+    MPI_Type_create_indexed_block(nlocal, 1, ff->disp, pairtype,
+                                  &ff->ftype);
+    MPI_Type_commit(&ff->ftype);
+    MPI_File_set_view(ff->fh, ff->hdr + (MPI_Offset) 8*ff->n*ff->frame,
+                      pairtype, ff->ftype, "external32", MPI_INFO_NULL);
+    MPI_File_iwrite_all(ff->fh, ff->buf, nlocal, pairtype, &ff->req);
+    ++ff->frame;
+}
+
+/* Make sure every frame so far is on disk, before a checkpoint */
+static void frame_file_sync(frame_file_t* ff)
+{
+    frame_file_ready(ff, 0);
+    MPI_File_sync(ff->fh);
+}
+
+static void frame_file_close(frame_file_t* ff)
+{
+    double wmax;
+    frame_file_ready(ff, 0);
+    MPI_File_close(&ff->fh);
+    if (ff->ftype != MPI_DATATYPE_NULL)
+        MPI_Type_free(&ff->ftype);
+    free(ff->disp);
+    free(ff->buf);
+    MPI_Reduce(&ff->wait, &wmax, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (rank == 0)
+        printf("Output: %d frames, waited %g s for writes (max over ranks)\n",
+               ff->frame, wmax);
+}
+
+/*@T
+ * \subsection{Parallel checkpoints}
+ *
+ * Checkpoints (see [[checkpoint.c]]) use the same idea as the
+ * frames: rank 0 writes the header, and every rank writes its own
+ * particles' $x$, $v$ and $a$ straight into place in the three arrays
+ * that follow, with a collective MPI-IO write each.  The file then
+ * looks exactly like one from the serial code, so any driver can
+ * resume from it.  Particles given by index ([[ids]], sorted) go
+ * through an indexed file type as in [[frame_file_write_ids]]; with
+ * [[owner]] set we also store each particle's rank, so that a strips
+ * run can be resumed with exactly the same distribution.
+ *@c*/
+static void ckpt_write_mpi(sim_param_t* params, int frame, int nlocal,
+                           int first, const int* ids, int owner,
+                           const float* x, const float* v, const float* a)
+{
+    ckpt_header_t h;
+    MPI_File fh;
+    MPI_Datatype ftype = pairtype, itype = MPI_INT;
+    MPI_Offset nbytes = 8*(MPI_Offset) params->npart;
+    const float* arrays[3] = { x, v, a };
+    char* tmp = (char*) malloc(strlen(params->ckpt)+5);
+
+    sprintf(tmp, "%s.tmp", params->ckpt);
+    ckpt_fill(&h, params, frame);
+    h.nowner = owner ? nproc : 0;
+
+    MPI_File_open(MPI_COMM_WORLD, tmp, MPI_MODE_WRONLY | MPI_MODE_CREATE,
+                  MPI_INFO_NULL, &fh);
+    MPI_File_set_size(fh, 0);
+    if (rank == 0)
+        MPI_File_write_at(fh, 0, &h, sizeof(h), MPI_BYTE, MPI_STATUS_IGNORE);
+
+    if (ids) {
+        MPI_Type_create_indexed_block(nlocal, 1, (int*) ids, pairtype,
+                                      &ftype);
+        MPI_Type_commit(&ftype);
+        first = 0;
+    }
+    for (int k = 0; k < 3; ++k) {
+        MPI_File_set_view(fh, sizeof(h) + k*nbytes + 8*(MPI_Offset) first,
+                          pairtype, ftype, "native", MPI_INFO_NULL);
+        MPI_File_write_all(fh, (void*) arrays[k], nlocal, pairtype,
+                           MPI_STATUS_IGNORE);
+    }
+    if (owner) {
+        int* who = (int*) malloc((nlocal+1)*sizeof(int));
+        for (int k = 0; k < nlocal; ++k)
+            who[k] = rank;
+        MPI_Type_create_indexed_block(nlocal, 1, (int*) ids, MPI_INT,
+                                      &itype);
+        MPI_Type_commit(&itype);
+        MPI_File_set_view(fh, sizeof(h) + 3*nbytes, MPI_INT, itype,
+                          "native", MPI_INFO_NULL);
+        MPI_File_write_all(fh, who, nlocal, MPI_INT, MPI_STATUS_IGNORE);
+        MPI_Type_free(&itype);
+        free(who);
+    }
+    MPI_File_close(&fh);
+    if (ids)
+        MPI_Type_free(&ftype);
+
+    if (rank == 0 && rename(tmp, params->ckpt) != 0)
+        fprintf(stderr, "Could not write checkpoint %s\n", params->ckpt);
+    free(tmp);
+}
+
+void run_box(const char* fname,        /* Output file name */
              int n, int nlocal,         /* Counts (all and local) */
              int* iparts, int* counts,  /* Offsets and counts per proc */
+             int frame0,                /* Start frame (0 if new) */
              int npframe,               /* Steps per frame */
              int nframes,               /* Frames */
              float dt,                  /* Time step */
              float* restrict x,         /* Global position vec */
              float* restrict xlocal,    /* Local part of position */
              float* restrict vlocal,    /* Local part of velocity */
+             float* restrict alocal,    /* Local part of acceleration */
              sim_param_t* params)       /* Simulation params */
 {
-    float* alocal = (float*) malloc(2*nlocal*sizeof(float));
-    memset(alocal, 0, 2*nlocal*sizeof(float));
+    int overlap = (strcmp(params->force, "overlap") == 0);
+    int ring    = (strcmp(params->force, "ring") == 0);
+    float* buf[2] = { NULL, NULL };
+    double times[2], tmax[2];
+    frame_file_t ff;
+    diag_t diag;
+    double* pe;
+    int behind = 0;  /* v still owes the last step's second half-kick */
 
-    if (fp) {
-        write_header(fp, n);
-        write_frame_data(fp, n, x);
+    if (ring) {
+        int nmax = 0;
+        for (int r = 0; r < nproc; ++r)
+            nmax = (counts[r] > nmax) ? counts[r] : nmax;
+        buf[0] = (float*) malloc(2*nmax*sizeof(float));
+        buf[1] = (float*) malloc(2*nmax*sizeof(float));
     }
 
-    compute_forces(n, x, iparts[rank], iparts[rank+1],
-                   xlocal, alocal, params);
+    frame_file_open(&ff, fname, n, frame0 ? frame0+1 : 0);
+    diag_open(&diag, params, (long) frame0*npframe, rank == 0);
+    if (frame0 == 0) {
+        frame_file_write(&ff, iparts[rank], nlocal, xlocal);
+        pe = diag_due(&diag, 0);
+        compute_forces(n, x, iparts[rank], iparts[rank+1],
+                       xlocal, alocal, params, pe);
+        if (pe)
+            diag_sample(&diag, params, 0, nlocal, xlocal, vlocal);
+    }
 
-    for (int frame = 1; frame < nframes; ++frame) {
+    t_compute = t_wait = 0;
+    for (int frame = frame0+1; frame < nframes; ++frame) {
         for (int i = 0; i < npframe; ++i) {
-            leapfrog1(nlocal, dt, xlocal, vlocal, alocal);
-            apply_reflect(nlocal, xlocal, vlocal, alocal);
-            MPI_Allgatherv(xlocal, nlocal, pairtype,
-                           x, counts, iparts, pairtype,
-                           MPI_COMM_WORLD);
-            compute_forces(n, x, iparts[rank], iparts[rank+1],
-                           xlocal, alocal, params);
-            leapfrog2(nlocal, dt, vlocal, alocal);
+            long step = (long) (frame-1)*npframe + i+1;
+            pe = diag_due(&diag, step);
+            if (behind)
+                leapfrog_step(nlocal, dt, xlocal, vlocal, alocal);
+            else
+                leapfrog_start(nlocal, dt, xlocal, vlocal, alocal);
+            if (overlap) {
+                exchange_overlap(n, x, nlocal, iparts, counts,
+                                 xlocal, alocal, params, pe);
+            } else if (ring) {
+                exchange_ring(nlocal, iparts, counts,
+                              xlocal, alocal, buf, params, pe);
+            } else {
+                double t0 = MPI_Wtime();
+                MPI_Allgatherv(xlocal, nlocal, pairtype,
+                               x, counts, iparts, pairtype,
+                               MPI_COMM_WORLD);
+                double t1 = MPI_Wtime();
+                compute_forces(n, x, iparts[rank], iparts[rank+1],
+                               xlocal, alocal, params, pe);
+                t_wait    += t1-t0;
+                t_compute += MPI_Wtime()-t1;
+            }
+            behind = 1;
+            if (pe) {
+                leapfrog2(nlocal, dt, vlocal, alocal);
+                behind = 0;
+                diag_sample(&diag, params, step, nlocal, xlocal, vlocal);
+            }
+        }
+        frame_file_write(&ff, iparts[rank], nlocal, xlocal);
+        if (params->nckpt > 0 && frame % params->nckpt == 0) {
+            frame_file_sync(&ff);
+            diag_sync(&diag);
+            if (behind) {
+                leapfrog2(nlocal, dt, vlocal, alocal);
+                behind = 0;
+            }
+            ckpt_write_mpi(params, frame, nlocal, iparts[rank], NULL, 0,
+                           xlocal, vlocal, alocal);
         }
-        if (fp)
-            write_frame_data(fp, n, x);
     }
+    if (behind)
+        leapfrog2(nlocal, dt, vlocal, alocal);
+    frame_file_close(&ff);
+    diag_close(&diag);
 
-    free(alocal);
+    times[0] = t_compute;
+    times[1] = t_wait;
+    MPI_Reduce(times, tmax, 2, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (rank == 0)
+        printf("Forces %g s, blocked in exchange %g s (max over ranks)\n",
+               tmax[0], tmax[1]);
+
+    free(buf[1]);
+    free(buf[0]);
+}
+
+/*@T
+ * \section{Spatial decomposition}
+ *
+ * The [[MPI_Allgatherv]] above sends every position to every rank on
+ * every step, so each rank moves $O(n)$ data no matter how short the
+ * range of the force is.  Lennard-Jones forces vanish beyond
+ * $r_c = 2.5\sigma$, so a rank only really needs the particles within
+ * $r_c$ of the region it is responsible for.  In the [[strips]] mode
+ * each rank owns a vertical strip of the box, $[x_r, x_{r+1})$ with
+ * $x_r = r (x_{\max}-x_{\min})/p$, and all the particles in it.  Each
+ * step it
+ * \begin{enumerate}
+ * \item advances its particles,
+ * \item hands any particle that left the strip to the neighbour on
+ *   that side (migration), and
+ * \item sends the neighbours copies of the positions within $r_c$ of
+ *   the shared edges (ghosts),
+ * \end{enumerate}
+ * and then computes forces on its own particles from its own plus the
+ * ghosts.  Communication is proportional to the length of the strip
+ * edges rather than to $n$.  Particles travel much less than a strip
+ * width per step, so only nearest neighbours ever talk; we insist that
+ * a strip is at least $r_c$ wide so the ghosts come from one
+ * neighbour on each side.
+ *
+ * A particle keeps its global index as it moves between ranks, which
+ * is what lets rank 0 put frames back in the original order.
+ *@c*/
+typedef struct strip_t {
+    int    n;       /* Particles owned by this rank        */
+    int    nghost;  /* Ghost positions after the owned ones */
+    int    nalloc;  /* Owned plus ghosts the arrays hold    */
+    int*   id;      /* Global index of each owned particle  */
+    float* x;       /* Positions, owned then ghosts         */
+    float* v;       /* Velocities of owned particles        */
+    float* a;       /* Accelerations, owned then ghosts     */
+    long   nmoved;  /* Particles migrated away so far       */
+    long   nsent;   /* Ghosts sent so far                   */
+} strip_t;
+
+typedef struct migrant_t {
+    int   id;
+    float x[2];
+    float v[2];
+} migrant_t;
+
+static int strip_owner(float x)
+{
+    int r = (int) ((x-XMIN)/(XMAX-XMIN)*nproc);
+    if (r < 0)      r = 0;
+    if (r >= nproc) r = nproc-1;
+    return r;
+}
+
+static void strip_reserve(strip_t* s, int need)
+{
+    if (need <= s->nalloc)
+        return;
+    s->nalloc = need + need/4;
+    s->id = (int*)   realloc(s->id, s->nalloc*sizeof(int));
+    s->x  = (float*) realloc(s->x,  2*s->nalloc*sizeof(float));
+    s->v  = (float*) realloc(s->v,  2*s->nalloc*sizeof(float));
+    s->a  = (float*) realloc(s->a,  2*s->nalloc*sizeof(float));
+}
+
+/*@T
+ *
+ * Both exchanges have the same shape: every rank sends a list to the
+ * left and a list to the right and gets one back from each side.  We
+ * swap the counts first so the receiver knows how much room to make.
+ * Ranks at the ends of the box talk to [[MPI_PROC_NULL]].
+ *@c*/
+static void strip_swap_counts(int nleft, int nright, int* fromleft,
+                              int* fromright)
+{
+    int left  = rank > 0       ? rank-1 : MPI_PROC_NULL;
+    int right = rank < nproc-1 ? rank+1 : MPI_PROC_NULL;
+    *fromleft = *fromright = 0;
+    MPI_Sendrecv(&nleft,  1, MPI_INT, left,  0,
+                 fromright, 1, MPI_INT, right, 0,
+                 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(&nright, 1, MPI_INT, right, 1,
+                 fromleft,  1, MPI_INT, left,  1,
+                 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+}
+
+static void strip_migrate(strip_t* s)
+{
+    int left  = rank > 0       ? rank-1 : MPI_PROC_NULL;
+    int right = rank < nproc-1 ? rank+1 : MPI_PROC_NULL;
+    migrant_t* out = (migrant_t*) malloc((s->n+1)*sizeof(migrant_t));
+    int nleft = 0, nright = 0, nkeep = 0;
+    int fromleft, fromright;
+
+    /* Leavers to the left fill out from the front, to the right from
+       the back; the stayers are compacted in place */
+    for (int i = 0; i < s->n; ++i) {
+        int owner = strip_owner(s->x[2*i+0]);
+        if (owner == rank) {
+            s->id[nkeep] = s->id[i];
+            memmove(s->x+2*nkeep, s->x+2*i, 2*sizeof(float));
+            memmove(s->v+2*nkeep, s->v+2*i, 2*sizeof(float));
+            ++nkeep;
+        } else {
+            migrant_t* m = (owner < rank) ? out + nleft++ : out + s->n-nright++;
+            m->id = s->id[i];
+            memcpy(m->x, s->x+2*i, 2*sizeof(float));
+            memcpy(m->v, s->v+2*i, 2*sizeof(float));
+        }
+    }
+    s->nmoved += nleft + nright;
+
+    strip_swap_counts(nleft, nright, &fromleft, &fromright);
+    migrant_t* in = (migrant_t*) malloc((fromleft+fromright+1)*sizeof(migrant_t));
+    MPI_Sendrecv(out, nleft*sizeof(migrant_t), MPI_BYTE, left, 2,
+                 in+fromleft, fromright*sizeof(migrant_t), MPI_BYTE, right, 2,
+                 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(out+s->n-nright+1, nright*sizeof(migrant_t), MPI_BYTE, right, 3,
+                 in, fromleft*sizeof(migrant_t), MPI_BYTE, left, 3,
+                 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+    s->n = nkeep;
+    strip_reserve(s, s->n + fromleft + fromright);
+    for (int k = 0; k < fromleft+fromright; ++k, ++s->n) {
+        s->id[s->n] = in[k].id;
+        memcpy(s->x+2*s->n, in[k].x, 2*sizeof(float));
+        memcpy(s->v+2*s->n, in[k].v, 2*sizeof(float));
+    }
+
+    free(in);
+    free(out);
+}
+
+static void strip_ghosts(strip_t* s, float rcut)
+{
+    int left  = rank > 0       ? rank-1 : MPI_PROC_NULL;
+    int right = rank < nproc-1 ? rank+1 : MPI_PROC_NULL;
+    float xlo = XMIN + (XMAX-XMIN)*rank/nproc;
+    float xhi = XMIN + (XMAX-XMIN)*(rank+1)/nproc;
+    float* out = (float*) malloc(4*(s->n+1)*sizeof(float));
+    float* outr = out + 2*(s->n+1);
+    int nleft = 0, nright = 0;
+    int fromleft, fromright;
+
+    for (int i = 0; i < s->n; ++i) {
+        if (left != MPI_PROC_NULL && s->x[2*i+0] < xlo+rcut) {
+            memcpy(out+2*nleft, s->x+2*i, 2*sizeof(float));
+            ++nleft;
+        }
+        if (right != MPI_PROC_NULL && s->x[2*i+0] >= xhi-rcut) {
+            memcpy(outr+2*nright, s->x+2*i, 2*sizeof(float));
+            ++nright;
+        }
+    }
+    s->nsent += nleft + nright;
+
+    strip_swap_counts(nleft, nright, &fromleft, &fromright);
+    s->nghost = fromleft + fromright;
+    strip_reserve(s, s->n + s->nghost);
+    float* ghosts = s->x + 2*s->n;
+    MPI_Sendrecv(out, nleft, pairtype, left, 4,
+                 ghosts+2*fromleft, fromright, pairtype, right, 4,
+                 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(outr, nright, pairtype, right, 5,
+                 ghosts, fromleft, pairtype, left, 5,
+                 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+    free(out);
+}
+
+/*@T
+ *
+ * The force on the owned particles comes from the owned particles and
+ * the ghosts together, so we bin both into one cell list and use the
+ * half-stencil loop from [[cells.c]].  That also computes the
+ * ghost-ghost pairs and the forces on the ghosts, which we simply
+ * ignore; both are small next to the work on the strip.  For the
+ * energy we tell the cell list which particles are our own, so that
+ * a pair across the edge counts half here and half on the neighbour.
+ *@c*/
+static void strip_forces(strip_t* s, cell_list_t* cl, sim_param_t* params,
+                         double* pe)
+{
+    int ntotal = s->n + s->nghost;
+    float sig  = params->sig_lj;
+
+    /* Global force downward (e.g. gravity) */
+    for (int i = 0; i < s->n; ++i) {
+        s->a[2*i+0] = 0;
+        s->a[2*i+1] = -params->G;
+    }
+    memset(s->a+2*s->n, 0, 2*s->nghost*sizeof(float));
+
+    cells_bin(cl, ntotal, s->x);
+    cl->nown = s->n;
+    cells_LJ_forces(cl, s->x, s->a, params->eps_lj, sig*sig, pe);
+}
+
+/*@T
+ *
+ * The order of the particles within a strip changes the order of the
+ * force sums, and so the last bits of the result.  A resumed run
+ * lays out each strip in index order, so at a checkpoint we sort the
+ * running strips the same way; then the two runs agree exactly.
+ *@c*/
+static void strip_sort(strip_t* s)
+{
+    int* perm = (int*) malloc((s->n+1)*sizeof(int));
+    int* id   = (int*) malloc((s->n+1)*sizeof(int));
+    float* buf = (float*) malloc((2*s->n+1)*sizeof(float));
+
+    for (int k = 0; k < s->n; ++k)
+        perm[k] = k;
+    sort_ids = s->id;
+    qsort(perm, s->n, sizeof(int), compare_ids);
+
+    for (int k = 0; k < s->n; ++k)
+        id[k] = s->id[perm[k]];
+    memcpy(s->id, id, s->n*sizeof(int));
+    float* arrays[3] = { s->x, s->v, s->a };
+    for (int j = 0; j < 3; ++j) {
+        for (int k = 0; k < s->n; ++k)
+            memcpy(buf+2*k, arrays[j]+2*perm[k], 2*sizeof(float));
+        memcpy(arrays[j], buf, 2*s->n*sizeof(float));
+    }
+    free(buf);
+    free(id);
+    free(perm);
+}
+
+void run_box_strips(const char* fname,        /* Output file name */
+                    int n,                     /* Particle count */
+                    int frame0,                /* Start frame (0 if new) */
+                    int npframe,               /* Steps per frame */
+                    int nframes,               /* Frames */
+                    float dt,                  /* Time step */
+                    strip_t* s,                /* Owned particles */
+                    sim_param_t* params)       /* Simulation params */
+{
+    float rcut = LJ_CUTOFF*params->sig_lj;
+    long totals[3], mine[3];
+    cell_list_t cl;
+    frame_file_t ff;
+    diag_t diag;
+    double* pe;
+    int behind = 0;  /* v still owes the last step's second half-kick */
+
+    cells_init(&cl, rcut);
+
+    frame_file_open(&ff, fname, n, frame0 ? frame0+1 : 0);
+    diag_open(&diag, params, (long) frame0*npframe, rank == 0);
+    if (frame0 == 0) {
+        frame_file_write_ids(&ff, s->n, s->id, s->x);
+        pe = diag_due(&diag, 0);
+        strip_ghosts(s, rcut);
+        strip_forces(s, &cl, params, pe);
+        if (pe)
+            diag_sample(&diag, params, 0, s->n, s->x, s->v);
+    }
+
+    for (int frame = frame0+1; frame < nframes; ++frame) {
+        for (int i = 0; i < npframe; ++i) {
+            long step = (long) (frame-1)*npframe + i+1;
+            pe = diag_due(&diag, step);
+            if (behind)
+                leapfrog_step(s->n, dt, s->x, s->v, s->a);
+            else
+                leapfrog_start(s->n, dt, s->x, s->v, s->a);
+            strip_migrate(s);
+            strip_ghosts(s, rcut);
+            strip_forces(s, &cl, params, pe);
+            behind = 1;
+            if (pe) {
+                leapfrog2(s->n, dt, s->v, s->a);
+                behind = 0;
+                diag_sample(&diag, params, step, s->n, s->x, s->v);
+            }
+        }
+        frame_file_write_ids(&ff, s->n, s->id, s->x);
+        if (params->nckpt > 0 && frame % params->nckpt == 0) {
+            frame_file_sync(&ff);
+            diag_sync(&diag);
+            if (behind) {
+                leapfrog2(s->n, dt, s->v, s->a);
+                behind = 0;
+            }
+            strip_sort(s);
+            ckpt_write_mpi(params, frame, s->n, 0, s->id, 1,
+                           s->x, s->v, s->a);
+        }
+    }
+    if (behind)
+        leapfrog2(s->n, dt, s->v, s->a);
+    frame_file_close(&ff);
+    diag_close(&diag);
+
+    /* Report how much actually moved between ranks per step */
+    mine[0] = s->nmoved;
+    mine[1] = s->nsent;
+    mine[2] = s->nsent;
+    MPI_Reduce(mine, totals, 2, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(mine+2, totals+2, 1, MPI_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (rank == 0 && nframes > frame0+1) {
+        long nsteps = (long) (nframes-1-frame0)*npframe;
+        printf("Strips: per step %.1f migrations, %.1f ghosts sent "
+               "(at most %.1f by one rank)\n",
+               (double) totals[0]/nsteps, (double) totals[1]/nsteps,
+               (double) totals[2]/nsteps);
+    }
+
+    cells_free(&cl);
 }
 
 /*@T
@@ -215,8 +936,18 @@ void run_box(FILE* fp,                  /* Output file (at 0) */
  *   before we can make such a constructed data type useable to the rest
  *   of the system.
  * \item
- *   We initialize on the first processor, then send information out to
- *   the others using an [[MPI_Bcast]].
+ *   Every rank builds the initial positions with
+ *   [[init_particles_random]]: the ranks fill the strips of the
+ *   occupancy grid between them, each from its own Philox stream,
+ *   and only the filled strips are broadcast.  Nothing else is sent;
+ *   a particle's velocity is a function of the seed and its index, so
+ *   each rank draws the ones it needs with [[init_velocities]].
+ * \item
+ *   With [[-m strips]] we use the spatial decomposition.  Particles
+ *   change owner as they move, so every rank then draws all the
+ *   velocities and keeps those of the particles in its strip; either
+ *   way a particle's initial state does not depend on the number of
+ *   ranks.
  * \end{enumerate}
  *@c*/
 int main(int argc, char** argv)
@@ -225,11 +956,13 @@ int main(int argc, char** argv)
     float* x;
     float* xlocal;
     float* vlocal;
-    FILE* fp = NULL;
+    float* alocal;
     int npart;
     int* iparts;
     int* counts;
     int nlocal;
+    int frame0 = 0;
+    ckpt_header_t h;
 
     MPI_Init(&argc, &argv);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
@@ -241,22 +974,107 @@ int main(int argc, char** argv)
         MPI_Finalize();
         exit(-1);
     }
+    if (strcmp(params.force, "all") != 0 &&
+        strcmp(params.force, "overlap") != 0 &&
+        strcmp(params.force, "ring") != 0 &&
+        strcmp(params.force, "strips") != 0) {
+        if (rank == 0)
+            fprintf(stderr, "Unknown force method %s\n", params.force);
+        MPI_Finalize();
+        exit(-1);
+    }
+    if (params.qbits != 0) {
+        if (rank == 0)
+            fprintf(stderr, "nbmpi writes only raw NBView01 frames; "
+                    "drop -q\n");
+        MPI_Finalize();
+        exit(-1);
+    }
+    if (strcmp(params.force, "strips") == 0 &&
+        (XMAX-XMIN)/nproc < LJ_CUTOFF*params.sig_lj) {
+        if (rank == 0)
+            fprintf(stderr, "Strips are narrower than the cutoff; "
+                    "use fewer ranks\n");
+        MPI_Finalize();
+        exit(-1);
+    }
 
-    /* Get file handle and initialize everything on P0 */
-    x = malloc(2*params.npart*sizeof(float));
-    if (rank == 0) {
-        fp = fopen(params.fname, "w");
+    /* Initialize everything, or pick up where a checkpoint left off */
+    if (params.restart) {
+        int ok = (ckpt_read_header(params.restart, &h) == 0);
+        if (ok) {
+            ckpt_restore(&h, &params);
+            frame0 = h.frame;
+        }
+        if (ok && rank == 0) {
+            FILE* fp = ckpt_reopen_output(params.fname, h.npart, frame0+1);
+            ok = (fp != NULL);
+            if (fp)
+                fclose(fp);
+        }
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN,
+                      MPI_COMM_WORLD);
+        if (!ok) {
+            if (rank == 0)
+                fprintf(stderr, "Cannot resume from %s into %s\n",
+                        params.restart, params.fname);
+            MPI_Finalize();
+            exit(-1);
+        }
+        npart = h.npart;
+        x = malloc(2*npart*sizeof(float));
+    } else {
+        x = malloc(2*params.npart*sizeof(float));
         npart = init_particles_random(params.npart, x, &params);
-        if (npart < params.npart) {
-            fprintf(stderr, "Could not generate %d particles; trying %d\n",
-                    params.npart, npart);
+        if (rank == 0 && npart < params.npart) {
+            fprintf(stderr, "Could not generate %d particles; "
+                    "trying %d\n", params.npart, npart);
         }
+        params.npart = npart;
     }
 
-    /* Broadcast initial information from root */
-    MPI_Bcast(&npart, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(x, npart, pairtype, 0, MPI_COMM_WORLD);
-    params.npart = npart;
+    if (strcmp(params.force, "strips") == 0) {
+        strip_t s = {0};
+        float* v = malloc(2*npart*sizeof(float));
+        float* a = calloc(2*npart, sizeof(float));
+        int* owner = NULL;
+        if (params.restart) {
+            if (ckpt_read(params.restart, &h, 0, npart, x, v, a) != 0)
+                MPI_Abort(MPI_COMM_WORLD, -1);
+            if (h.nowner == nproc) {
+                owner = malloc(npart*sizeof(int));
+                if (ckpt_read_owners(params.restart, &h, owner) != 0)
+                    MPI_Abort(MPI_COMM_WORLD, -1);
+            }
+        } else {
+            init_velocities(0, npart, v, &params);
+        }
+        for (int i = 0; i < npart; ++i) {
+            int r = owner ? owner[i] : strip_owner(x[2*i+0]);
+            if (r != rank)
+                continue;
+            strip_reserve(&s, s.n+1);
+            s.id[s.n] = i;
+            memcpy(s.x+2*s.n, x+2*i, 2*sizeof(float));
+            memcpy(s.v+2*s.n, v+2*i, 2*sizeof(float));
+            memcpy(s.a+2*s.n, a+2*i, 2*sizeof(float));
+            ++s.n;
+        }
+        free(owner);
+        free(a);
+        free(v);
+
+        run_box_strips(params.fname, npart, frame0, params.npframe,
+                       params.nframes, params.dt, &s, &params);
+
+        free(s.a);
+        free(s.v);
+        free(s.x);
+        free(s.id);
+        free(x);
+        MPI_Finalize();
+        return 0;
+    }
 
     /* Decide who is responsible for which item */
     counts = malloc( nproc   *sizeof(int));
@@ -267,19 +1085,27 @@ int main(int argc, char** argv)
     /* Allocate space for local storage and copy in data */
     xlocal = malloc(2*nlocal*sizeof(float));
     vlocal = malloc(2*nlocal*sizeof(float));
-    memcpy(xlocal, x+2*iparts[rank], 2*nlocal*sizeof(float));
-    init_particles_random_v(nlocal, vlocal, &params);
+    alocal = calloc(2*nlocal, sizeof(float));
+    if (params.restart) {
+        if (ckpt_read(params.restart, &h, iparts[rank], nlocal,
+                      xlocal, vlocal, alocal) != 0)
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        MPI_Allgatherv(xlocal, nlocal, pairtype, x, counts, iparts,
+                       pairtype, MPI_COMM_WORLD);
+    } else {
+        memcpy(xlocal, x+2*iparts[rank], 2*nlocal*sizeof(float));
+        init_velocities(iparts[rank], nlocal, vlocal, &params);
+    }
 
-    run_box(fp, npart, nlocal, iparts, counts,
-            params.npframe, params.nframes, 
-            params.dt, x, xlocal, vlocal, &params);
+    run_box(params.fname, npart, nlocal, iparts, counts, frame0,
+            params.npframe, params.nframes,
+            params.dt, x, xlocal, vlocal, alocal, &params);
 
+    free(alocal);
     free(vlocal);
     free(xlocal);
     free(iparts);
     free(x);
-    if (fp)
-        fclose(fp);
 
     MPI_Finalize();
     return 0;
@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <arpa/inet.h>
 
 
@@ -60,23 +62,51 @@ void write_header(FILE* fp, int n)
 /*@T
  * 
  * After the header is a sequence of frames, each of which contains
- * $n_{\mathrm{particles}}$ pairs of 32-bit int floating point numbers.
+ * $n_{\mathrm{particles}}$ pairs of 32-bit floating point numbers.
  * There are no markers, end tags, etc; just the raw data.
  * The [[write_frame_data]] routine writes $n$ pairs of floats;
  * note that writing a single frame of output may involve multiple
- * calls to [[write_frame_data]]
- * Frame data just consists
- * integer) and a scale parameter (a 32-bit floating point number).
- * The scale parameter tells the viewer how big the view box is supposed
- * to be in the coordinate system of the simulation; right now, it is
- * always set to be 1 (i.e. the view box is $[0,1] \times [0,1]$)
+ * calls to [[write_frame_data]].
+ *
+ * Writing the pairs one [[fwrite]] at a time costs two library calls
+ * per particle, which at a million particles is as slow as the time
+ * steps between frames.  Instead we byte-swap the whole batch into a
+ * scratch buffer in one pass and hand it to [[fwrite]] in one call.
+ * The swap loop has no dependencies between iterations, so the compiler
+ * turns it into vector byte shuffles (on a big-endian host it is
+ * just a copy, as with [[htonl]]).  The buffer is kept between calls
+ * and only grows, and it is aligned to a cache line so the vector
+ * stores never straddle lines.
  *@c*/
+static uint32_t* frame_buf = NULL;
+static int frame_buf_len = 0;
+
+static uint32_t* frame_buffer(int len)
+{
+    if (len > frame_buf_len) {
+        void* p = NULL;
+        free(frame_buf);
+        if (posix_memalign(&p, 64, len * sizeof(uint32_t)) != 0) {
+            fprintf(stderr, "Could not allocate %d-float frame buffer\n", len);
+            exit(-1);
+        }
+        frame_buf = (uint32_t*) p;
+        frame_buf_len = len;
+    }
+    return frame_buf;
+}
+
 void write_frame_data(FILE* fp, int n, float* x)
 {
-    for (int i = 0; i < n; ++i) {
-        uint32_t xi = htonf(x++);
-        uint32_t yi = htonf(x++);
-        fwrite(&xi, sizeof(xi), 1, fp);
-        fwrite(&yi, sizeof(yi), 1, fp);
+    uint32_t* restrict buf = frame_buffer(2*n);
+    for (int i = 0; i < 2*n; ++i) {
+        uint32_t xi;
+        memcpy(&xi, x+i, sizeof(xi));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        buf[i] = __builtin_bswap32(xi);
+#else
+        buf[i] = xi;
+#endif
     }
+    fwrite(buf, sizeof(uint32_t), 2*n, fp);
 }
@@ -5,7 +5,12 @@
 #include <omp.h>
 
 #include "common.h"
+#include "cells.h"
 #include "nbody_io.h"
+#include "frame_writer.h"
+#include "checkpoint.h"
+#include "diag.h"
+#include "init.h"
 #include "params.h"
 
 
@@ -28,7 +33,7 @@
  * the serial code takes.  We can do better.
  *
  *@c*/
-static float** Ftemp;
+static float** Ftemp = NULL;
 
 void ftemp_init(sim_param_t* params)
 {
@@ -45,37 +50,124 @@ void ftemp_destroy()
     free(Ftemp);
 }
 
-void compute_forces(int n, const float* restrict x, float* restrict F, 
-                    sim_param_t* params)
+static void external_forces(int n, float* restrict F, sim_param_t* params)
 {
-    float g    = params->G;
-    float eps  = params->eps_lj;
-    float sig  = params->sig_lj;
-    float sig2 = sig*sig;
+    float g = params->G;
 
     /* Global force downward (e.g. gravity) */
     for (int i = 0; i < n; ++i) {
         F[2*i+0] = 0;
         F[2*i+1] = -g;
     }
+}
+
+/*@T
+ *
+ * Splitting the symmetric loop by rows balances badly: row $i$ has
+ * $n-i-1$ partners, so with a static schedule the first thread does
+ * about twice the average work and the last one almost none.  Instead
+ * we cut the upper triangle into $b \times b$ tiles of particle
+ * blocks $(I, J)$ with $I \leq J$.  An off-diagonal tile has $b^2$
+ * pairs and a diagonal one about half that, so we bundle diagonal
+ * tiles $I$ and $n_b-1-I$ into one work item.  Every item then costs
+ * about the same, and a dynamic schedule hands them out.  The tile
+ * size is the [[-b]] option; [[-b 0]] gives back the row loop.
+ *
+ * Each thread records how long it spends in the pair loop, so that
+ * [[run_box]] can report the load balance.  The loop ends with
+ * [[nowait]]: the callers decide when they need a barrier, and the
+ * time we record is work, not waiting.
+ *
+ * On the steps that take a diagnostic sample (see [[diag.c]]) the
+ * callers pass a [[pe]] that is not [[NULL]].  Each thread then sums
+ * the potential of its own pairs into a private total, and adds that
+ * to [[*pe]] once, atomically, when its share of the loop is done.
+ *@c*/
+static double* busy;    /* Seconds each thread spent on pairs */
+
+static void tile_forces(int i0, int i1, int j0, int j1,
+                        const float* restrict x, float* restrict Ft,
+                        float eps, float sig2, double* pe)
+{
+    double u = 0;
+    for (int i = i0; i < i1; ++i) {
+        for (int j = (j0 > i+1) ? j0 : i+1; j < j1; ++j) {
+            float dx = x[2*j+0]-x[2*i+0];
+            float dy = x[2*j+1]-x[2*i+1];
+            float r2 = dx*dx+dy*dy;
+            float C_LJ = compute_LJ_scalar(r2, eps, sig2);
+            Ft[2*i+0] += (C_LJ*dx);
+            Ft[2*i+1] += (C_LJ*dy);
+            Ft[2*j+0] -= (C_LJ*dx);
+            Ft[2*j+1] -= (C_LJ*dy);
+            if (pe)
+                u += potential_LJ_cut(r2, eps, sig2);
+        }
+    }
+    if (pe)
+        *pe += u;
+}
+
+static void pair_forces(int n, const float* restrict x, float* restrict Ft,
+                        float eps, float sig2, int b, double* pe)
+{
+    double t0 = omp_get_wtime();
+
+    if (b <= 0) {
+        #pragma omp for schedule(static) nowait
+        for (int i = 0; i < n; ++i)
+            tile_forces(i, i+1, i+1, n, x, Ft, eps, sig2, pe);
+    } else {
+        int nb    = (n+b-1)/b;
+        int noff  = nb*(nb-1)/2;  /* Off-diagonal tiles     */
+        int ndiag = (nb+1)/2;     /* Pairs of diagonal ones */
+
+        #pragma omp for schedule(dynamic) nowait
+        for (int w = 0; w < noff+ndiag; ++w) {
+            if (w < noff) {
+                int I = 0, r = w;
+                while (r >= nb-1-I) {
+                    r -= nb-1-I;
+                    ++I;
+                }
+                int J = I+1+r;
+                tile_forces(I*b, (I+1)*b, J*b, (J+1)*b < n ? (J+1)*b : n,
+                            x, Ft, eps, sig2, pe);
+            } else {
+                int I = w-noff;
+                int K = nb-1-I;
+                int iend = (I+1)*b < n ? (I+1)*b : n;
+                int kend = (K+1)*b < n ? (K+1)*b : n;
+                tile_forces(I*b, iend, I*b, iend, x, Ft, eps, sig2, pe);
+                if (K != I)
+                    tile_forces(K*b, kend, K*b, kend, x, Ft, eps, sig2, pe);
+            }
+        }
+    }
+
+    busy[omp_get_thread_num()] += omp_get_wtime()-t0;
+}
+
+void compute_forces(int n, const float* restrict x, float* restrict F, 
+                    double* pe, sim_param_t* params)
+{
+    float eps  = params->eps_lj;
+    float sig  = params->sig_lj;
+    float sig2 = sig*sig;
+
+    external_forces(n, F, params);
 
     /* Particle-particle interactions (Lennard-Jones) */
     #pragma omp parallel shared(F,x,n)
     {
         float* Ft = Ftemp[omp_get_thread_num()];
+        double u = 0;
         memset(Ft, 0, 2*n*sizeof(float));
 
-        #pragma omp for schedule(static)
-        for (int i = 0; i < n; ++i) {
-            for (int j = i+1; j < n; ++j) {
-                float dx = x[2*j+0]-x[2*i+0];
-                float dy = x[2*j+1]-x[2*i+1];
-                float C_LJ = compute_LJ_scalar(dx*dx+dy*dy, eps, sig2);
-                Ft[2*i+0] += (C_LJ*dx);
-                Ft[2*i+1] += (C_LJ*dy);
-                Ft[2*j+0] -= (C_LJ*dx);
-                Ft[2*j+1] -= (C_LJ*dy);
-            }
+        pair_forces(n, x, Ft, eps, sig2, params->tile, pe ? &u : NULL);
+        if (pe) {
+            #pragma omp atomic
+            *pe += u;
         }
 
         #pragma omp critical
@@ -86,58 +178,161 @@ void compute_forces(int n, const float* restrict x, float* restrict F,
 
 /*@T
  *
- * The rest of the OpenMP code is nearly identical to the serial code.
- *@q*/
+ * The [[critical]] merge at the end is $O(n p)$ work done one thread
+ * at a time, and the scratch space also grows like $np$.  The
+ * simplest way around both is to give up on the symmetry: if each
+ * thread computes the whole force on its own particles, summing over
+ * all $j \neq i$, then nobody writes anybody else's entries and there
+ * is nothing to merge.  We do twice the flops, but with no scratch
+ * arrays and no synchronization beyond the end of the loop.  Each
+ * pair is seen from both ends, so each sighting carries half the
+ * pair's potential energy.
+ *@c*/
+void compute_forces_full(int n, const float* restrict x, float* restrict F, 
+                         double* pe, sim_param_t* params)
+{
+    float eps  = params->eps_lj;
+    float sig  = params->sig_lj;
+    float sig2 = sig*sig;
 
-/*
- * \subsection{Initial conditions}
+    external_forces(n, F, params);
+
+    #pragma omp parallel shared(F,x,n)
+    {
+        double t0 = omp_get_wtime();
+        double u = 0;
+
+        #pragma omp for schedule(static) nowait
+        for (int i = 0; i < n; ++i) {
+            float xi = x[2*i+0];
+            float yi = x[2*i+1];
+            float fx = 0, fy = 0;
+            for (int j = 0; j < n; ++j) {
+                if (j == i)
+                    continue;
+                float dx = x[2*j+0]-xi;
+                float dy = x[2*j+1]-yi;
+                float r2 = dx*dx+dy*dy;
+                float C_LJ = compute_LJ_scalar(r2, eps, sig2);
+                fx += (C_LJ*dx);
+                fy += (C_LJ*dy);
+                if (pe)
+                    u += potential_LJ_cut(r2, eps, sig2);
+            }
+            F[2*i+0] += fx;
+            F[2*i+1] += fy;
+        }
+        if (pe) {
+            #pragma omp atomic
+            *pe += 0.5*u;
+        }
+
+        busy[omp_get_thread_num()] += omp_get_wtime()-t0;
+    }
+}
+
+/*@T
  *
- * We choose the particle velocity components to be normal with mean zero
- * and variance $T_0^2$, and we choose the particles uniformly at random
- * subject to the constrain that no too particles can be closer than
- * the basic interaction radius of Lennard-Jones lest the simulation
- * blow up on the first time steps (we choose $r_{\min} =
- * \sigma)$. It's possible to set the parameters such that we can't
- * place as many particles as desired subject to this constraint; if
- * that happens, we try to place as many as possible, then bail out.
- */
-int init_particles_random(int n, float* x, float* v, sim_param_t* params)
+ * If we want to keep the symmetric loop, we can at least do the
+ * merge in parallel.  We combine the per-thread arrays pairwise, in
+ * $\lceil \log_2 p \rceil$ rounds: in round $s$ every array $t$ with
+ * $t \equiv 0 \pmod{2s}$ picks up array $t+s$.  Within each round the
+ * threads split the entries between them, so the merge costs $O(n
+ * \log p)$ time instead of $O(np)$.
+ *@c*/
+void compute_forces_tree(int n, const float* restrict x, float* restrict F, 
+                         double* pe, sim_param_t* params)
 {
-    const int MAX_INIT_TRIALS = 1000;
+    float eps  = params->eps_lj;
+    float sig  = params->sig_lj;
+    float sig2 = sig*sig;
 
-    float T0     = params->T0;
-    float sig    = params->sig_lj;
-    float min_r2 = sig*sig;
+    external_forces(n, F, params);
 
-    for (int i = 0; i < n; ++i) {
-        float r2 = 0;
-
-        /* Choose velocity components from N(0,T0) */
-        double R = T0 * sqrt(-2*log(drand48()));
-        double T = 2*M_PI*drand48();
-        v[2*i+0] = (float) (R * cos(T));
-        v[2*i+1] = (float) (R * sin(T));
-
-        /* Choose new point via rejection sampling */
-        for (int trial = 0; r2 < min_r2 && trial < MAX_INIT_TRIALS; ++trial) {
-            x[2*i+0] = (float) drand48();
-            x[2*i+1] = (float) drand48();
-            for (int j = 0; j < i; ++j) {
-                float dx = x[2*i+0]-x[2*j+0];
-                float dy = x[2*i+1]-x[2*j+1];
-                r2 = dx*dx + dy*dy;
-                if (r2 < min_r2)
-                    break;
-            }
+    #pragma omp parallel shared(F,x,n)
+    {
+        int nth = omp_get_num_threads();
+        float* Ft = Ftemp[omp_get_thread_num()];
+        double u = 0;
+        memset(Ft, 0, 2*n*sizeof(float));
+
+        pair_forces(n, x, Ft, eps, sig2, params->tile, pe ? &u : NULL);
+        if (pe) {
+            #pragma omp atomic
+            *pe += u;
         }
+        #pragma omp barrier
+
+        for (int s = 1; s < nth; s *= 2) {
+            #pragma omp for schedule(static)
+            for (int k = 0; k < 2*n; ++k)
+                for (int t = 0; t+s < nth; t += 2*s)
+                    Ftemp[t][k] += Ftemp[t+s][k];
+        }
+
+        #pragma omp for schedule(static)
+        for (int k = 0; k < 2*n; ++k)
+            F[k] += Ftemp[0][k];
+    }
+}
+
+/*@T
+ *
+ * With a cell list (see [[cells.c]]) we can keep both the symmetry
+ * and a single force array.  The half stencil of cell $(i_x, i_y)$
+ * writes to particles in cells $i_x-1$ through $i_x+1$ of rows $i_y$
+ * and $i_y+1$.  If we colour the cells by $(i_x \bmod 3, i_y \bmod 2)$,
+ * two cells of the same colour never touch the same particle, so all
+ * cells of one colour can be processed in parallel straight into
+ * [[F]].  The six colours are done one after another, with the
+ * implicit barrier at the end of each loop in between.  Cells hold
+ * different numbers of particles, so we hand them out dynamically.
+ *@c*/
+static cell_list_t cells;
+
+void compute_forces_color(int n, const float* restrict x, float* restrict F, 
+                          double* pe, sim_param_t* params)
+{
+    float eps  = params->eps_lj;
+    float sig  = params->sig_lj;
+    float sig2 = sig*sig;
+    int nx = cells.nx;
+    int ny = cells.ny;
+
+    external_forces(n, F, params);
+    cells_bin(&cells, n, x);
+
+    #pragma omp parallel shared(F,x,n)
+    {
+        double u = 0;
+        for (int color = 0; color < 6; ++color) {
+            int ix0 = color % 3;
+            int iy0 = color / 3;
+            int ncx = (nx-ix0+2)/3;
+            int ncy = (ny-iy0+1)/2;
+
+            double t0 = omp_get_wtime();
+
+            #pragma omp for schedule(dynamic) nowait
+            for (int c = 0; c < ncx*ncy; ++c)
+                cells_LJ_cell_forces(&cells, ix0 + 3*(c % ncx),
+                                     iy0 + 2*(c / ncx),
+                                     x, F, eps, sig2, pe ? &u : NULL);
 
-        /* If it takes too many trials, bail and declare victory! */
-        if (i > 0 && r2 < min_r2) 
-            return i;
+            busy[omp_get_thread_num()] += omp_get_wtime()-t0;
+            #pragma omp barrier
+        }
+        if (pe) {
+            #pragma omp atomic
+            *pe += u;
+        }
     }
-    return n;
 }
 
+/*@T
+ *
+ * The rest of the OpenMP code is nearly identical to the serial code.
+ *@q*/
 
 /*
  * \subsection{Simulating a box}
@@ -149,35 +344,96 @@ int init_particles_random(int n, float* x, float* v, sim_param_t* params)
  * we use a callback function to compute the force fields at each
  * step.
  */
+typedef void (*compute_force_t)(int n, const float* restrict x,
+                                float* restrict F, double* pe,
+                                sim_param_t* params);
+
 void run_box(FILE* fp,              /* Output file */
-             int n,                 /* Number of particles */
-             int npframe,           /* Number of steps between frames */
-             int nframes,           /* Number of frames generated */
-             float dt,              /* Time step */
+             int frame0,            /* Frame to start from (0 if new) */
              float* restrict x,     /* Initial positions */
              float* restrict v,     /* Initial velocities */
+             float* restrict a,     /* Initial accelerations */
+             compute_force_t force, /* Function to compute force */
              sim_param_t* params)   /* Simulation parameters */
 {
-    float* a = (float*) malloc(2*n*sizeof(float));
+    int   n       = params->npart;
+    int   npframe = params->npframe;
+    int   nframes = params->nframes;
+    float dt      = params->dt;
+    int nth = omp_get_max_threads();
+    double total = 0, most = 0;
+    frame_writer_t fw;
+    diag_t diag;
+    double s[DIAG_NSUM];
+    double* pe;
+    int behind = 0;  /* v still owes the last step's second half-kick */
 
-    memset(a, 0, 2*n*sizeof(float));
-    ftemp_init(params);
+    busy = (double*) calloc(nth, sizeof(double));
+    if (force == compute_forces || force == compute_forces_tree)
+        ftemp_init(params);
+    if (force == compute_forces_color)
+        cells_init(&cells, LJ_CUTOFF*params->sig_lj);
 
-    write_header(fp, n);
-    write_frame_data(fp, n, x);
-    compute_forces(n, x, a, params);
-    for (int frame = 1; frame < nframes; ++frame) {
+    frame_writer_init(&fw, fp, n, FRAME_NBUF, params->qbits, frame0 > 0);
+    diag_open(&diag, params, (long) frame0*npframe, 1);
+    if (frame0 == 0) {
+        frame_writer_push(&fw, x);
+        pe = diag_due(&diag, 0);
+        force(n, x, a, pe, params);
+        if (pe) {
+            diag_sums(n, x, v, *pe, s);
+            diag_write(&diag, params, 0, s);
+        }
+    }
+    for (int frame = frame0+1; frame < nframes; ++frame) {
         for (int i = 0; i < npframe; ++i) {
-            leapfrog1(n, dt, x, v, a);
-            apply_reflect(n, x, v, a);
-            compute_forces(n, x, a, params);
-            leapfrog2(n, dt, v, a);
+            long step = (long) (frame-1)*npframe + i+1;
+            pe = diag_due(&diag, step);
+            if (behind)
+                leapfrog_step(n, dt, x, v, a);
+            else
+                leapfrog_start(n, dt, x, v, a);
+            force(n, x, a, pe, params);
+            behind = 1;
+            if (pe) {
+                leapfrog2(n, dt, v, a);
+                behind = 0;
+                diag_sums(n, x, v, *pe, s);
+                diag_write(&diag, params, step, s);
+            }
+        }
+        frame_writer_push(&fw, x);
+        if (params->nckpt > 0 && frame % params->nckpt == 0) {
+            frame_writer_sync(&fw);
+            diag_sync(&diag);
+            if (behind) {
+                leapfrog2(n, dt, v, a);
+                behind = 0;
+            }
+            ckpt_save(params, frame, x, v, a);
         }
-        write_frame_data(fp, n, x);
     }
+    if (behind)
+        leapfrog2(n, dt, v, a);
+    frame_writer_free(&fw);
+    diag_close(&diag);
+    printf("Output: %d frames, ring full %d times, stalled %g s\n",
+           fw.nframes, fw.nstall, fw.stall);
 
-    ftemp_destroy();
-    free(a);
+    /* Load balance of the pair loops */
+    for (int t = 0; t < nth; ++t) {
+        printf("Thread %d: %g s in force loops\n", t, busy[t]);
+        total += busy[t];
+        most = (busy[t] > most) ? busy[t] : most;
+    }
+    if (total > 0)
+        printf("Imbalance (max/mean): %.2f\n", most*nth/total);
+    free(busy);
+
+    if (force == compute_forces_color)
+        cells_free(&cells);
+    if (Ftemp)
+        ftemp_destroy();
 }
 
 /*
@@ -185,29 +441,51 @@ void run_box(FILE* fp,              /* Output file */
  */
 int main(int argc, char** argv)
 {
+    compute_force_t force = compute_forces;
     sim_param_t params;
     float* x;
     float* v;
+    float* a;
     FILE* fp;
     int npart;
+    int frame0 = 0;
 
     if (get_params(argc, argv, &params) != 0)
         exit(-1);
 
-    fp = fopen(params.fname, "w");
-    x = malloc(2*params.npart*sizeof(float));
-    v = malloc(2*params.npart*sizeof(float));
+    if (strcmp(params.force, "full") == 0)
+        force = compute_forces_full;
+    else if (strcmp(params.force, "tree") == 0)
+        force = compute_forces_tree;
+    else if (strcmp(params.force, "color") == 0)
+        force = compute_forces_color;
+    else if (strcmp(params.force, "all") != 0) {
+        fprintf(stderr, "Unknown force method %s\n", params.force);
+        exit(-1);
+    }
+
+    if (params.restart) {
+        frame0 = ckpt_resume(&params, &fp, &x, &v, &a);
+        if (frame0 < 0)
+            exit(-1);
+    } else {
+        fp = fopen(params.fname, "w");
+        x = malloc(2*params.npart*sizeof(float));
+        v = malloc(2*params.npart*sizeof(float));
+        a = calloc(2*params.npart, sizeof(float));
 
-    npart = init_particles_random(params.npart, x, v, &params);
-    if (npart < params.npart) {
-        fprintf(stderr, "Could not generate %d particles; trying %d\n",
-                params.npart, npart);
-        params.npart = npart;
+        npart = init_positions(params.npart, x, &params);
+        init_velocities(0, npart, v, &params);
+        if (npart < params.npart) {
+            fprintf(stderr, "Could not generate %d particles; trying %d\n",
+                    params.npart, npart);
+            params.npart = npart;
+        }
     }
 
-    run_box(fp, params.npart, params.npframe, params.nframes, 
-            params.dt, x, v, &params);
+    run_box(fp, frame0, x, v, a, force, &params);
 
+    free(a);
     free(v);
     free(x);
     fclose(fp);
@@ -5,7 +5,13 @@
 #include <math.h>
 
 #include "common.h"
+#include "cells.h"
+#include "soa.h"
 #include "nbody_io.h"
+#include "frame_writer.h"
+#include "checkpoint.h"
+#include "diag.h"
+#include "init.h"
 #include "params.h"
 
 /*@T
@@ -20,21 +26,26 @@
  *
  * The assumed data layout of the [[x]] array is 
  * $[x_1, y_1, x_2, y_2, \ldots, x_n, y_n]$.
- * The [[F]] array is treated similarly.
+ * The [[F]] array is treated similarly.  If [[pe]] is not [[NULL]],
+ * the force field also adds its pair potential energy to [[*pe]]
+ * (see [[diag.c]]).
  *@c*/
 typedef
 void (*compute_force_t)(int n,                    /* Particle count */
                         const float* restrict x,  /* Positions */
                         float* restrict F,        /* Forces */
+                        double* pe,               /* Energy, or NULL */
                         void* fdata);             /* Parameters */
 
 /*@T
  *
- * Despite the function abstraction, right now there's only one force
- * computation: Lennard-Jones potential plus a gravitational field.
+ * There is one force field --- Lennard-Jones potential plus a
+ * gravitational field --- but several ways to evaluate it: the direct
+ * loop over all pairs below, its SIMD structure-of-arrays version,
+ * and the cell-list and Verlet-list versions after those.
  *@c*/
 void compute_forces(int n, const float* restrict x, float* restrict F, 
-                    void* fdata)
+                    double* pe, void* fdata)
 {
     sim_param_t* params = (sim_param_t*) fdata;
     float g    = params->G;
@@ -49,68 +60,114 @@ void compute_forces(int n, const float* restrict x, float* restrict F,
     }
 
     /* Particle-particle interactions (Lennard-Jones) */
+    double u = 0;
     for (int i = 0; i < n; ++i) {
         for (int j = i+1; j < n; ++j) {
             float dx = x[2*j+0]-x[2*i+0];
             float dy = x[2*j+1]-x[2*i+1];
-            float C_LJ = compute_LJ_scalar(dx*dx+dy*dy, eps, sig2);
+            float r2 = dx*dx+dy*dy;
+            float C_LJ = compute_LJ_scalar(r2, eps, sig2);
             F[2*i+0] += (C_LJ*dx);
             F[2*i+1] += (C_LJ*dy);
             F[2*j+0] -= (C_LJ*dx);
             F[2*j+1] -= (C_LJ*dy);
+            if (pe)
+                u += potential_LJ_cut(r2, eps, sig2);
         }
     }
+    if (pe)
+        *pe += u;
 }
 
 /*@T
- * \subsection{Initial conditions}
  *
- * We choose the particle velocity components to be normal with mean zero
- * and variance $T_0^2$, and we choose the particles uniformly at random
- * subject to the constrain that no too particles can be closer than
- * the basic interaction radius of Lennard-Jones lest the simulation
- * blow up on the first time steps (we choose $r_{\min} =
- * \sigma)$. It's possible to set the parameters such that we can't
- * place as many particles as desired subject to this constraint; if
- * that happens, we try to place as many as possible, then bail out.
+ * The SIMD version (see [[soa.c]]) copies the positions into its own
+ * aligned arrays on every call, which is $O(n)$ against the $O(n^2)$
+ * pair loop.
  *@c*/
-int init_particles_random(int n, float* x, float* v, sim_param_t* params)
-{
-    const int MAX_INIT_TRIALS = 1000;
+typedef struct soa_force_data_t {
+    sim_param_t*    params;
+    particles_soa_t soa;
+} soa_force_data_t;
 
-    float T0     = params->T0;
-    float sig    = params->sig_lj;
-    float min_r2 = sig*sig;
+void compute_forces_soa(int n, const float* restrict x, float* restrict F,
+                        double* pe, void* fdata)
+{
+    soa_force_data_t* data = (soa_force_data_t*) fdata;
+    sim_param_t* params = data->params;
+    float g    = params->G;
+    float eps  = params->eps_lj;
+    float sig  = params->sig_lj;
+    float sig2 = sig*sig;
 
+    /* Global force downward (e.g. gravity) */
     for (int i = 0; i < n; ++i) {
-        float r2 = 0;
-
-        /* Choose velocity components from N(0,T0) */
-        double R = T0 * sqrt(-2*log(drand48()));
-        double T = 2*M_PI*drand48();
-        v[2*i+0] = (float) (R * cos(T));
-        v[2*i+1] = (float) (R * sin(T));
-
-        /* Choose new point via rejection sampling */
-        for (int trial = 0; r2 < min_r2 && trial < MAX_INIT_TRIALS; ++trial) {
-            x[2*i+0] = (float) drand48();
-            x[2*i+1] = (float) drand48();
-            for (int j = 0; j < i; ++j) {
-                float dx = x[2*i+0]-x[2*j+0];
-                float dy = x[2*i+1]-x[2*j+1];
-                r2 = dx*dx + dy*dy;
-                if (r2 < min_r2)
-                    break;
-            }
-        }
+        F[2*i+0] = 0;
+        F[2*i+1] = -g;
+    }
+
+    /* Particle-particle interactions (Lennard-Jones) */
+    soa_load(&data->soa, x);
+    soa_LJ_forces(&data->soa, eps, sig2, pe);
+    soa_store_forces(&data->soa, F);
+}
 
-        /* If it takes too many trials, bail and declare victory! */
-        if (i > 0 && r2 < min_r2) 
-            return i;
+/*@T
+ *
+ * The cell-list version needs the cell structure along with the
+ * parameters, so it gets a slightly bigger [[fdata]] record.  The
+ * particles are re-binned on every call; binning is $O(n)$, the same
+ * as the force loop, so there is no point in being cleverer.
+ * The Verlet-list version shares the record, and only re-bins when
+ * its list has gone stale.
+ *@c*/
+typedef struct cell_force_data_t {
+    sim_param_t*  params;
+    cell_list_t   cells;
+    verlet_list_t verlet;
+} cell_force_data_t;
+
+void compute_forces_cells(int n, const float* restrict x, float* restrict F,
+                          double* pe, void* fdata)
+{
+    cell_force_data_t* data = (cell_force_data_t*) fdata;
+    sim_param_t* params = data->params;
+    float g    = params->G;
+    float eps  = params->eps_lj;
+    float sig  = params->sig_lj;
+    float sig2 = sig*sig;
+
+    /* Global force downward (e.g. gravity) */
+    for (int i = 0; i < n; ++i) {
+        F[2*i+0] = 0;
+        F[2*i+1] = -g;
     }
-    return n;
+
+    /* Particle-particle interactions (Lennard-Jones) */
+    cells_bin(&data->cells, n, x);
+    cells_LJ_forces(&data->cells, x, F, eps, sig2, pe);
 }
 
+void compute_forces_verlet(int n, const float* restrict x, float* restrict F,
+                           double* pe, void* fdata)
+{
+    cell_force_data_t* data = (cell_force_data_t*) fdata;
+    sim_param_t* params = data->params;
+    float g    = params->G;
+    float eps  = params->eps_lj;
+    float sig  = params->sig_lj;
+    float sig2 = sig*sig;
+
+    /* Global force downward (e.g. gravity) */
+    for (int i = 0; i < n; ++i) {
+        F[2*i+0] = 0;
+        F[2*i+1] = -g;
+    }
+
+    /* Particle-particle interactions (Lennard-Jones) */
+    verlet_update(&data->verlet, &data->cells, n, x);
+    verlet_LJ_forces(&data->verlet, x, F, eps, sig2, pe);
+}
 
 /*@T
  * \subsection{Simulating a box}
@@ -120,35 +177,84 @@ int init_particles_random(int n, float* x, float* v, sim_param_t* params)
  * integration scheme.  Every [[npframes]] time steps, a frame is
  * written to the output file.  As described in the previous section,
  * we use a callback function to compute the force fields at each
- * step.
+ * step.  A run resumed from a checkpoint at frame [[frame0]] already
+ * has that frame in the output and its accelerations in [[a]], so it
+ * goes straight to the time steps.  With [[-D]], the steps that are
+ * due for a sample ask the force field for the potential energy too,
+ * and write the diagnostics once the velocities have caught up.
+ *
+ * The half-kick that ends one step is folded into the pass that
+ * starts the next (see [[leapfrog_step]]), so between steps the
+ * velocities are usually half a step behind; [[behind]] says so, and
+ * we catch them up whenever something is about to look at them.
  *@c*/
 void run_box(FILE* fp,              /* Output file */
-             int n,                 /* Number of particles */
-             int npframe,           /* Number of steps between frames */
-             int nframes,           /* Number of frames generated */
-             float dt,              /* Time step */
+             sim_param_t* params,   /* Run and output parameters */
+             int frame0,            /* Frame to start from (0 if new) */
              float* restrict x,     /* Initial positions */
              float* restrict v,     /* Initial velocities */
+             float* restrict a,     /* Initial accelerations */
              compute_force_t force, /* Function to compute force */
              void* force_data)      /* Data used by force() */
 {
-    float* a = (float*) malloc(2*n*sizeof(float));
-    memset(a, 0, 2*n*sizeof(float));
+    int   n       = params->npart;
+    int   npframe = params->npframe;
+    int   nframes = params->nframes;
+    float dt      = params->dt;
+    frame_writer_t fw;
+    diag_t diag;
+    double s[DIAG_NSUM];
+    double* pe;
+    int behind = 0;  /* v still owes the last step's second half-kick */
 
-    write_header(fp, n);
-    write_frame_data(fp, n, x);
-    force(n, x, a, force_data);
-    for (int frame = 1; frame < nframes; ++frame) {
+    frame_writer_init(&fw, fp, n, FRAME_NBUF, params->qbits, frame0 > 0);
+    diag_open(&diag, params, (long) frame0*npframe, 1);
+    if (frame0 == 0) {
+        frame_writer_push(&fw, x);
+        pe = diag_due(&diag, 0);
+        force(n, x, a, pe, force_data);
+        if (pe) {
+            diag_sums(n, x, v, *pe, s);
+            diag_write(&diag, params, 0, s);
+        }
+    }
+    for (int frame = frame0+1; frame < nframes; ++frame) {
         for (int i = 0; i < npframe; ++i) {
-            leapfrog1(n, dt, x, v, a);
-            apply_reflect(n, x, v, a);
-            force(n, x, a, force_data);
-            leapfrog2(n, dt, v, a);
+            long step = (long) (frame-1)*npframe + i+1;
+            pe = diag_due(&diag, step);
+            if (behind)
+                leapfrog_step(n, dt, x, v, a);
+            else
+                leapfrog_start(n, dt, x, v, a);
+            force(n, x, a, pe, force_data);
+            behind = 1;
+            if (pe) {
+                leapfrog2(n, dt, v, a);
+                behind = 0;
+                diag_sums(n, x, v, *pe, s);
+                diag_write(&diag, params, step, s);
+            }
+        }
+        frame_writer_push(&fw, x);
+        if (params->nckpt > 0 && frame % params->nckpt == 0) {
+            frame_writer_sync(&fw);
+            diag_sync(&diag);
+            if (behind) {
+                leapfrog2(n, dt, v, a);
+                behind = 0;
+            }
+            ckpt_save(params, frame, x, v, a);
+            /* A resumed run starts with no list; match it */
+            if (force == compute_forces_verlet)
+                ((cell_force_data_t*) force_data)->verlet.n = -1;
         }
-        write_frame_data(fp, n, x);
     }
-
-    free(a);
+    if (behind)
+        leapfrog2(n, dt, v, a);
+    frame_writer_free(&fw);
+    diag_close(&diag);
+    printf("Output: %d frames, ring full %d times, stalled %g s\n",
+           fw.nframes, fw.nstall, fw.stall);
 }
 
 /*@T
@@ -159,26 +265,72 @@ int main(int argc, char** argv)
     sim_param_t params;
     float* x;
     float* v;
+    float* a;
     FILE* fp;
     int npart;
+    int frame0 = 0;
 
     if (get_params(argc, argv, &params) != 0)
         exit(-1);
+    if (strcmp(params.force, "all") != 0 &&
+        strcmp(params.force, "soa") != 0 &&
+        strcmp(params.force, "cells") != 0 &&
+        strcmp(params.force, "verlet") != 0) {
+        fprintf(stderr, "Unknown force method %s\n", params.force);
+        exit(-1);
+    }
 
-    fp = fopen(params.fname, "w");
-    x = malloc(2*params.npart*sizeof(float));
-    v = malloc(2*params.npart*sizeof(float));
+    if (params.restart) {
+        frame0 = ckpt_resume(&params, &fp, &x, &v, &a);
+        if (frame0 < 0)
+            exit(-1);
+    } else {
+        fp = fopen(params.fname, "w");
+        x = malloc(2*params.npart*sizeof(float));
+        v = malloc(2*params.npart*sizeof(float));
+        a = calloc(2*params.npart, sizeof(float));
 
-    npart = init_particles_random(params.npart, x, v, &params);
-    if (npart < params.npart) {
-        fprintf(stderr, "Could not generate %d particles; trying %d\n",
-                params.npart, npart);
-        params.npart = npart;
+        npart = init_positions(params.npart, x, &params);
+        init_velocities(0, npart, v, &params);
+        if (npart < params.npart) {
+            fprintf(stderr, "Could not generate %d particles; trying %d\n",
+                    params.npart, npart);
+            params.npart = npart;
+        }
     }
 
-    run_box(fp, params.npart, params.npframe, params.nframes, 
-            params.dt, x, v, compute_forces, &params);
+    if (strcmp(params.force, "soa") == 0) {
+        soa_force_data_t data;
+        data.params = &params;
+        soa_alloc(&data.soa, params.npart);
+        run_box(fp, &params, frame0, x, v, a, compute_forces_soa, &data);
+        soa_free(&data.soa);
+    } else if (strcmp(params.force, "cells") == 0) {
+        cell_force_data_t data;
+        data.params = &params;
+        cells_init(&data.cells, LJ_CUTOFF*params.sig_lj);
+        run_box(fp, &params, frame0, x, v, a, compute_forces_cells, &data);
+        cells_free(&data.cells);
+    } else if (strcmp(params.force, "verlet") == 0) {
+        cell_force_data_t data;
+        float rcut = LJ_CUTOFF*params.sig_lj;
+        float skin = params.skin*params.sig_lj;
+        data.params = &params;
+        cells_init(&data.cells, rcut+skin);
+        verlet_init(&data.verlet, rcut, skin);
+        run_box(fp, &params, frame0, x, v, a, compute_forces_verlet, &data);
+        printf("Verlet lists: %d builds in %d steps (every %.1f steps), "
+               "%.1f neighbours per particle\n",
+               data.verlet.nbuild, data.verlet.ncalls,
+               (double) data.verlet.ncalls / data.verlet.nbuild,
+               2.0 * data.verlet.npairs / data.verlet.nbuild / params.npart);
+        verlet_free(&data.verlet);
+        cells_free(&data.cells);
+    } else {
+        run_box(fp, &params, frame0, x, v, a, compute_forces, &params);
+    }
 
+    free(a);
     free(v);
     free(x);
     fclose(fp);
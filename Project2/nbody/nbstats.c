@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <omp.h>
+
+#include "nbview.h"
+
+
+/*@T
+ * \section{Trajectory statistics}
+ *
+ * The [[nbstats]] tool is a small example of analysis on top of the
+ * reader: for every frame it reports the centre of mass, the RMS
+ * distance the particles moved since the previous frame (a rough
+ * thermometer), and the mean squared displacement from the first
+ * frame (which grows linearly in time once the gas is diffusing).
+ * Frames are independent, so the threads split them between them;
+ * each frame touches only itself, its predecessor, and frame 0, all
+ * read in place from the mapping.
+ *@c*/
+typedef struct frame_stats_t {
+    double xc, yc;   /* Centre of mass                */
+    double step;     /* RMS move since previous frame */
+    double msd;      /* Mean square move from frame 0 */
+} frame_stats_t;
+
+static void frame_stats(const nbview_t* v, int f, frame_stats_t* s)
+{
+    nbview_frame_t fr = nbview_frame(v, f);
+    nbview_frame_t fp = nbview_frame(v, f > 0 ? f-1 : 0);
+    nbview_frame_t f0 = nbview_frame(v, 0);
+    double xc = 0, yc = 0, step = 0, msd = 0;
+
+    for (int i = 0; i < v->n; ++i) {
+        float x  = nbview_coord(fr, 2*i+0);
+        float y  = nbview_coord(fr, 2*i+1);
+        float dx = x - nbview_coord(fp, 2*i+0);
+        float dy = y - nbview_coord(fp, 2*i+1);
+        float ex = x - nbview_coord(f0, 2*i+0);
+        float ey = y - nbview_coord(f0, 2*i+1);
+        xc   += x;
+        yc   += y;
+        step += dx*dx + dy*dy;
+        msd  += ex*ex + ey*ey;
+    }
+    s->xc   = xc / v->n;
+    s->yc   = yc / v->n;
+    s->step = sqrt(step / v->n);
+    s->msd  = msd / v->n;
+}
+
+int main(int argc, char** argv)
+{
+    nbview_t v;
+    frame_stats_t* stats;
+    double t0, t1;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: nbstats.x run.out\n");
+        return -1;
+    }
+    if (nbview_open(&v, argv[1]) != 0) {
+        fprintf(stderr, "Could not read %s as NBView00 or NBView01\n",
+                argv[1]);
+        return -1;
+    }
+    if (!v.binary) {
+        fprintf(stderr, "nbstats reads NBView01 files only\n");
+        nbview_close(&v);
+        return -1;
+    }
+
+    stats = (frame_stats_t*) malloc(v.nframes*sizeof(frame_stats_t));
+    t0 = omp_get_wtime();
+    #pragma omp parallel for schedule(dynamic)
+    for (int f = 0; f < v.nframes; ++f)
+        frame_stats(&v, f, stats+f);
+    t1 = omp_get_wtime();
+
+    printf("# frame  x_cm      y_cm      rms_step    msd\n");
+    for (int f = 0; f < v.nframes; ++f)
+        printf("%7d  %.6f  %.6f  %.4e  %.4e\n", f, stats[f].xc,
+               stats[f].yc, stats[f].step, stats[f].msd);
+    fprintf(stderr, "%d frames of %d particles in %g s on %d threads\n",
+            v.nframes, v.n, t1-t0, omp_get_max_threads());
+
+    free(stats);
+    nbview_close(&v);
+    return 0;
+}
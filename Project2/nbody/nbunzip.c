@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "traj.h"
+#include "nbody_io.h"
+
+
+/*@T
+ * \section{Trajectory decoder}
+ *
+ * The viewer only knows the [[NBView01]] format, so [[nbunzip]]
+ * turns a compressed trajectory back into one.  By default it writes
+ * every frame; a range of frames can be given to cut a short clip
+ * out of a long run, which only decodes from the key frame before
+ * the first frame wanted.
+ *@c*/
+int main(int argc, char** argv)
+{
+    traj_reader_t tr;
+    int first, last;
+    FILE* fp;
+    float* x;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: nbunzip.x in.nbz out.bin [first [last]]\n");
+        return -1;
+    }
+    if (traj_read_open(&tr, argv[1]) != 0) {
+        fprintf(stderr, "%s is not an NBView02 file\n", argv[1]);
+        return -1;
+    }
+    first = (argc > 3) ? atoi(argv[3]) : 0;
+    last  = (argc > 4) ? atoi(argv[4]) : tr.nframes-1;
+    if (first < 0 || last >= tr.nframes || first > last) {
+        fprintf(stderr, "Frames must be in 0 to %d\n", tr.nframes-1);
+        traj_read_close(&tr);
+        return -1;
+    }
+
+    fp = fopen(argv[2], "w");
+    if (!fp) {
+        fprintf(stderr, "Could not open %s\n", argv[2]);
+        traj_read_close(&tr);
+        return -1;
+    }
+    x = (float*) malloc(2*tr.n*sizeof(float));
+    write_header(fp, tr.n);
+    for (int f = first; f <= last; ++f) {
+        traj_read_frame(&tr, f, x);
+        write_frame_data(fp, tr.n, x);
+    }
+    fclose(fp);
+
+    printf("%d particles, %d frames at %d bits; %.1f bytes per frame "
+           "(%.1fx smaller than NBView01)\n",
+           tr.n, tr.nframes, tr.bits,
+           (double) (tr.index[tr.nframes]-tr.index[0]) / tr.nframes,
+           8.0 * tr.n * tr.nframes / (tr.index[tr.nframes]-tr.index[0]));
+    free(x);
+    traj_read_close(&tr);
+    return 0;
+}
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nbview.h"
+
+
+/*@T
+ * \section{Reading trajectories}
+ *
+ * Post-processing should not need to rerun the simulation, and it
+ * should not need to read a 100 GB trajectory into memory either.
+ * So the reader maps the output file with [[mmap]] and lets the
+ * operating system page frames in as they are touched.  Opening the
+ * file only reads the header and builds a table of frame offsets:
+ * for [[NBView01]] every frame is $8n$ bytes and the table is just
+ * arithmetic; for the text format [[NBView00]] we find the frame
+ * boundaries by counting lines once.  Either way we only count
+ * complete frames, so a file from a run that is still going (or
+ * died) can be read up to its last full frame.
+ *
+ * A binary frame is handed out as a view into the mapping, without
+ * copying anything; [[nbview_coord]] swaps the bytes of a coordinate
+ * only when it is asked for.  Since views are read-only, any number
+ * of threads can work on different frames (or the same one) at once.
+ *@c*/
+static size_t skip_lines(const uint8_t* p, size_t pos, size_t size,
+                         int nlines)
+{
+    for (int k = 0; k < nlines; ++k) {
+        const uint8_t* nl = memchr(p+pos, '\n', size-pos);
+        if (!nl)
+            return 0;
+        pos = nl-p+1;
+    }
+    return pos;
+}
+
+static int build_index(nbview_t* v)
+{
+    const char* p = (const char*) v->base;
+    size_t hdr;
+
+    if (v->size >= 9 && strncmp(p, "NBView01\n", 9) == 0) {
+        uint32_t nn, ns;
+        if (v->size < 17)
+            return -1;
+        memcpy(&nn, p+9,  4);
+        memcpy(&ns, p+13, 4);
+        nn = ntohl(nn);
+        ns = ntohl(ns);
+        v->binary = 1;
+        v->n = (int) nn;
+        memcpy(&v->scale, &ns, sizeof(v->scale));
+        hdr = 17;
+        if (v->n <= 0)
+            return -1;
+        v->nframes = (int) ((v->size-hdr) / (8*(size_t) v->n));
+        v->index = (size_t*) malloc((v->nframes+1)*sizeof(size_t));
+        for (int f = 0; f <= v->nframes; ++f)
+            v->index[f] = hdr + (size_t) f*8*v->n;
+        return 0;
+    }
+
+    if (v->size >= 9 && strncmp(p, "NBView00 ", 9) == 0) {
+        int nalloc = 64;
+        v->binary = 0;
+        v->n = atoi(p+9);
+        v->scale = 1;
+        hdr = skip_lines(v->base, 0, v->size, 1);
+        if (hdr == 0 || v->n <= 0)
+            return -1;
+        v->index = (size_t*) malloc(nalloc*sizeof(size_t));
+        v->index[0] = hdr;
+        v->nframes = 0;
+        for (;;) {
+            size_t next = skip_lines(v->base, v->index[v->nframes],
+                                     v->size, v->n);
+            if (next == 0)
+                break;
+            if (++v->nframes == nalloc) {
+                nalloc *= 2;
+                v->index = (size_t*) realloc(v->index,
+                                             nalloc*sizeof(size_t));
+            }
+            v->index[v->nframes] = next;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+int nbview_open(nbview_t* v, const char* fname)
+{
+    struct stat st;
+    int fd;
+    void* p;
+
+    memset(v, 0, sizeof(*v));
+    fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return -1;
+
+    v->base = (const uint8_t*) p;
+    v->size = st.st_size;
+    if (build_index(v) != 0) {
+        nbview_close(v);
+        return -1;
+    }
+    return 0;
+}
+
+void nbview_close(nbview_t* v)
+{
+    free(v->index);
+    if (v->base)
+        munmap((void*) v->base, v->size);
+    memset(v, 0, sizeof(*v));
+}
+
+/*@T
+ *
+ * Frames can also be copied out as ordinary floats, which is what
+ * [[nbview_read_frame]] does for either format.  For a binary file
+ * it is one pass of byte swaps, which the compiler vectorises; the
+ * text format has to be parsed.
+ *@c*/
+nbview_frame_t nbview_frame(const nbview_t* v, int frame)
+{
+    nbview_frame_t fr;
+    fr.n   = v->n;
+    fr.raw = v->binary ? v->base + v->index[frame] : NULL;
+    return fr;
+}
+
+void nbview_read_frame(const nbview_t* v, int frame, float* x)
+{
+    if (v->binary) {
+        nbview_frame_t fr = nbview_frame(v, frame);
+        for (int k = 0; k < 2*v->n; ++k)
+            x[k] = nbview_coord(fr, k);
+    } else {
+        const char* p = (const char*) v->base + v->index[frame];
+        for (int k = 0; k < 2*v->n; ++k) {
+            char* end;
+            x[k] = strtof(p, &end);
+            p = end;
+        }
+    }
+}
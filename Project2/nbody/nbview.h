@@ -0,0 +1,43 @@
+#ifndef NBVIEW_H
+#define NBVIEW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/* Read-only mapping of an NBView00 (text) or NBView01 (binary) file */
+typedef struct nbview_t {
+    int            binary;   /* NBView01 (1) or NBView00 (0)        */
+    int            n;        /* Particles per frame                 */
+    float          scale;    /* View box size from the header       */
+    int            nframes;  /* Complete frames in the file         */
+    const uint8_t* base;     /* Start of the mapping                */
+    size_t         size;     /* Bytes mapped                        */
+    size_t*        index;    /* Offset of each frame (nframes+1)    */
+} nbview_t;
+
+/* A frame of an NBView01 file, still big-endian, read in place */
+typedef struct nbview_frame_t {
+    int             n;
+    const uint8_t*  raw;     /* x0, y0, x1, y1, ... as stored       */
+} nbview_frame_t;
+
+int  nbview_open(nbview_t* v, const char* fname);
+void nbview_close(nbview_t* v);
+nbview_frame_t nbview_frame(const nbview_t* v, int frame);
+void nbview_read_frame(const nbview_t* v, int frame, float* x);
+
+/* Coordinate k (2i for x_i, 2i+1 for y_i) of a binary frame; frames
+ * start 17 bytes into the file, so the words are not aligned */
+static inline float nbview_coord(nbview_frame_t fr, int k)
+{
+    uint32_t u;
+    float f;
+    memcpy(&u, fr.raw + 4*k, sizeof(u));
+    u = ntohl(u);
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+#endif /* NBVIEW_H */
@@ -22,6 +22,20 @@ static void print_usage()
             "nbody\n"
             "\t-h: print this message\n"
             "\t-o: output file name (run.out)\n"
+            "\t-q: bits per coordinate for compressed NBView02 output,\n"
+            "\t    1 to 24; 0 for raw floats (0)\n"
+            "\t-C: frames between checkpoints to <output>.ckpt,\n"
+            "\t    0 for none (0)\n"
+            "\t-R: resume from this checkpoint, appending to the output\n"
+            "\t-D: steps between energy and momentum samples to\n"
+            "\t    <output>.diag, 0 for none (0)\n"
+            "\t-i: initial positions, random or lattice (random)\n"
+            "\t-m: force method (all)\n"
+            "\t    nbserial: all, soa, cells or verlet\n"
+            "\t    nbomp: all, full, tree or color\n"
+            "\t    nbmpi: all, overlap, ring or strips\n"
+            "\t-k: Verlet list skin in units of sigma (1)\n"
+            "\t-b: nbomp pair tile size, 0 for whole rows (128)\n"
             "\t-n: number of particles (500)\n"
             "\t-F: number of frames (200)\n"
             "\t-f: steps per frame (100)\n"
@@ -29,12 +43,15 @@ static void print_usage()
             "\t-e: epsilon parameter in LJ potential (1)\n"
             "\t-s: distance parameter in LJ potential (1e-2)\n"
             "\t-g: gravitational field strength (1)\n"
-            "\t-T: initial temperature (1)\n");
+            "\t-T: initial temperature (1)\n"
+            "\t-S: random seed for the initial conditions (1)\n");
 }
 
 static void default_params(sim_param_t* params)
 {
     params->fname   = "run.out";
+    params->force   = "all";
+    params->init    = "random";
     params->npart   = 500;
     params->nframes = 400;
     params->npframe = 50;
@@ -43,6 +60,13 @@ static void default_params(sim_param_t* params)
     params->sig_lj  = 1e-2;
     params->G       = 1;
     params->T0      = 1;
+    params->seed    = 1;
+    params->skin    = 1;
+    params->tile    = 128;
+    params->qbits   = 0;
+    params->nckpt   = 0;
+    params->restart = NULL;
+    params->ndiag   = 0;
 }
 
 /*@T
@@ -56,7 +80,7 @@ static void default_params(sim_param_t* params)
 int get_params(int argc, char** argv, sim_param_t* params)
 {
     extern char* optarg;
-    const char* optstring = "ho:n:F:f:t:e:s:g:T:";
+    const char* optstring = "ho:m:i:n:F:f:t:e:s:g:T:S:k:b:q:C:R:D:";
     int c;
 
     #define get_int_arg(c, field) \
@@ -73,6 +97,15 @@ int get_params(int argc, char** argv, sim_param_t* params)
         case 'o':
             strcpy(params->fname = malloc(strlen(optarg)+1), optarg);
             break;
+        case 'm':
+            strcpy(params->force = malloc(strlen(optarg)+1), optarg);
+            break;
+        case 'i':
+            strcpy(params->init = malloc(strlen(optarg)+1), optarg);
+            break;
+        case 'R':
+            strcpy(params->restart = malloc(strlen(optarg)+1), optarg);
+            break;
         get_int_arg('n', npart);
         get_int_arg('F', nframes);
         get_int_arg('f', npframe);
@@ -81,10 +114,35 @@ int get_params(int argc, char** argv, sim_param_t* params)
         get_flt_arg('s', sig_lj);
         get_flt_arg('g', G);
         get_flt_arg('T', T0);
+        get_flt_arg('k', skin);
+        get_int_arg('b', tile);
+        get_int_arg('q', qbits);
+        get_int_arg('C', nckpt);
+        get_int_arg('D', ndiag);
+        case 'S':
+            params->seed = atol(optarg);
+            break;
         default:
             fprintf(stderr, "Unknown option\n");
             return -1;
         }
     }
+    if (strcmp(params->init, "random") != 0 &&
+        strcmp(params->init, "lattice") != 0) {
+        fprintf(stderr, "Unknown initial layout %s\n", params->init);
+        return -1;
+    }
+    if (params->qbits < 0 || params->qbits > 24) {
+        fprintf(stderr, "Bits per coordinate must be 0 to 24\n");
+        return -1;
+    }
+    if (params->qbits && (params->nckpt || params->restart)) {
+        fprintf(stderr, "Checkpoints need raw NBView01 output; drop -q\n");
+        return -1;
+    }
+    params->ckpt = malloc(strlen(params->fname)+6);
+    sprintf(params->ckpt, "%s.ckpt", params->fname);
+    params->diag = malloc(strlen(params->fname)+6);
+    sprintf(params->diag, "%s.diag", params->fname);
     return 0;
 }
@@ -10,6 +10,8 @@
  *@c*/
 typedef struct sim_param_t {
     char* fname;   /* File name (run.out)        */
+    char* force;   /* Force method (all)         */
+    char* init;    /* Initial layout (random)    */
     int   npart;   /* Number of particles (500)  */
     int   nframes; /* Number of frames (200)     */
     int   npframe; /* Steps per frame (100)      */
@@ -18,6 +20,15 @@ typedef struct sim_param_t {
     float sig_lj;  /* Radius for L-J   (1e-2)    */
     float G;       /* Gravitational strength (1) */
     float T0;      /* Initial temperature (1)    */
+    long  seed;    /* Random seed (1)            */
+    float skin;    /* Verlet skin / sigma (1)    */
+    int   tile;    /* Pair tile size, nbomp (128)*/
+    int   qbits;   /* Output bits/coordinate (0) */
+    int   nckpt;   /* Frames per checkpoint (0)  */
+    char* ckpt;    /* Checkpoint (run.out.ckpt)  */
+    char* restart; /* Checkpoint to resume (none)*/
+    int   ndiag;   /* Steps per diagnostic (0)   */
+    char* diag;    /* Diagnostics (run.out.diag) */
 } sim_param_t;
 
 int get_params(int argc, char** argv, sim_param_t* params);
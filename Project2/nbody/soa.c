@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "common.h"
+#include "soa.h"
+
+
+/*@T
+ * \section{Structure-of-arrays force kernels}
+ *
+ * The interleaved $[x_1, y_1, x_2, y_2, \ldots]$ layout is convenient
+ * for the integrator, but it is awkward for the inner loop of the pair
+ * computation: to fill a SIMD register with $x_j$ values we would have
+ * to gather every other float.  For the all-pairs kernel we therefore
+ * copy positions into separate [[x]] and [[y]] arrays, aligned to a
+ * cache line and padded to a whole number of SIMD registers.  The
+ * padding particles sit far outside the box, so the cutoff test
+ * masks them out without any special casing.
+ *@c*/
+#define SOA_FAR 1e6f
+
+static float* soa_array(int npad)
+{
+    void* p = NULL;
+    if (posix_memalign(&p, 64, npad*sizeof(float)) != 0)
+        return NULL;
+    return (float*) p;
+}
+
+void soa_alloc(particles_soa_t* p, int n)
+{
+    p->n    = n;
+    p->npad = ((n + SOA_WIDTH-1)/SOA_WIDTH)*SOA_WIDTH;
+    p->x    = soa_array(p->npad);
+    p->y    = soa_array(p->npad);
+    p->fx   = soa_array(p->npad);
+    p->fy   = soa_array(p->npad);
+    for (int i = n; i < p->npad; ++i) {
+        p->x[i] = SOA_FAR;
+        p->y[i] = SOA_FAR;
+    }
+}
+
+void soa_free(particles_soa_t* p)
+{
+    free(p->fy);
+    free(p->fx);
+    free(p->y);
+    free(p->x);
+}
+
+void soa_load(particles_soa_t* p, const float* restrict x)
+{
+    for (int i = 0; i < p->n; ++i) {
+        p->x[i] = x[2*i+0];
+        p->y[i] = x[2*i+1];
+    }
+}
+
+/*@T
+ *
+ * The kernel accumulates into [[fx]] and [[fy]]; we add those into the
+ * interleaved force array (which already holds the external field).
+ *@c*/
+void soa_store_forces(const particles_soa_t* p, float* restrict F)
+{
+    for (int i = 0; i < p->n; ++i) {
+        F[2*i+0] += p->fx[i];
+        F[2*i+1] += p->fy[i];
+    }
+}
+
+/*@T
+ *
+ * The SIMD kernel keeps the symmetric formulation.  For each $i$, the
+ * $j$ loop starts at the register containing $i+1$ and runs over whole
+ * registers of partners.  Lanes with $j \leq i$ or $r^2 \geq r_c^2$ are
+ * masked off, and the masked force scalar is zero, so those lanes add
+ * nothing to $F_i$ and subtract nothing from $F_j$.  Instead of
+ * dividing by $r^2$ we take the hardware reciprocal estimate and
+ * refine it with one Newton step, $y \leftarrow y(2 - r^2 y)$, which
+ * gets us to nearly full single precision.  There are AVX-512 and AVX2+FMA
+ * versions; anything else gets the scalar loop.
+ *
+ * If [[pe]] is not [[NULL]], the kernel also sums the shifted pair
+ * potential $4\epsilon u(u-1) - V(r_c)$, with $u = (\sigma^2/r^2)^3$
+ * already at hand from the force, in a register of its own that is
+ * masked the same way, and adds the total into [[*pe]].
+ *@c*/
+#if defined(__AVX512F__)
+
+void soa_LJ_forces(particles_soa_t* p, float eps, float sig2, double* pe)
+{
+    int n = p->n;
+    const __m512 rc2  = _mm512_set1_ps(LJ_CUTOFF*LJ_CUTOFF*sig2);
+    const __m512 vsig2 = _mm512_set1_ps(sig2);
+    const __m512 c24  = _mm512_set1_ps(24*eps);
+    const __m512 one  = _mm512_set1_ps(1.0f);
+    const __m512 two  = _mm512_set1_ps(2.0f);
+    const __m512i lane = _mm512_set_epi32(15,14,13,12,11,10,9,8,
+                                          7,6,5,4,3,2,1,0);
+    const __m512 c4   = _mm512_set1_ps(4*eps);
+    const __m512 vc   = _mm512_set1_ps(potential_LJ(LJ_CUTOFF*LJ_CUTOFF*sig2,
+                                                    eps, sig2));
+    __m512 vsum = _mm512_setzero_ps();
+
+    memset(p->fx, 0, p->npad*sizeof(float));
+    memset(p->fy, 0, p->npad*sizeof(float));
+
+    for (int i = 0; i < n; ++i) {
+        __m512 xi = _mm512_set1_ps(p->x[i]);
+        __m512 yi = _mm512_set1_ps(p->y[i]);
+        __m512 fxi = _mm512_setzero_ps();
+        __m512 fyi = _mm512_setzero_ps();
+        int j0 = ((i+1)/16)*16;
+
+        for (int j = j0; j < p->npad; j += 16) {
+            __m512 dx = _mm512_sub_ps(_mm512_load_ps(p->x+j), xi);
+            __m512 dy = _mm512_sub_ps(_mm512_load_ps(p->y+j), yi);
+            __m512 r2 = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+            __mmask16 m = _mm512_cmp_ps_mask(r2, rc2, _CMP_LT_OQ) &
+                _mm512_cmpgt_epi32_mask(_mm512_add_epi32(lane,
+                                        _mm512_set1_epi32(j)),
+                                        _mm512_set1_epi32(i));
+            if (!m)
+                continue;
+
+            __m512 y = _mm512_rcp14_ps(r2);
+            y = _mm512_mul_ps(y, _mm512_fnmadd_ps(r2, y, two));
+            __m512 z = _mm512_mul_ps(vsig2, y);
+            __m512 u = _mm512_mul_ps(_mm512_mul_ps(z, z), z);
+            __m512 C = _mm512_mul_ps(_mm512_mul_ps(c24, y),
+                       _mm512_mul_ps(u, _mm512_fnmadd_ps(two, u, one)));
+            C = _mm512_maskz_mov_ps(m, C);
+            if (pe)
+                vsum = _mm512_mask_add_ps(vsum, m, vsum,
+                    _mm512_fmsub_ps(_mm512_mul_ps(c4, u),
+                                    _mm512_sub_ps(u, one), vc));
+
+            __m512 cx = _mm512_mul_ps(C, dx);
+            __m512 cy = _mm512_mul_ps(C, dy);
+            fxi = _mm512_add_ps(fxi, cx);
+            fyi = _mm512_add_ps(fyi, cy);
+            _mm512_store_ps(p->fx+j, _mm512_sub_ps(_mm512_load_ps(p->fx+j), cx));
+            _mm512_store_ps(p->fy+j, _mm512_sub_ps(_mm512_load_ps(p->fy+j), cy));
+        }
+        p->fx[i] += _mm512_reduce_add_ps(fxi);
+        p->fy[i] += _mm512_reduce_add_ps(fyi);
+    }
+    if (pe)
+        *pe += _mm512_reduce_add_ps(vsum);
+}
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+static float hsum256(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+void soa_LJ_forces(particles_soa_t* p, float eps, float sig2, double* pe)
+{
+    int n = p->n;
+    const __m256 rc2  = _mm256_set1_ps(LJ_CUTOFF*LJ_CUTOFF*sig2);
+    const __m256 vsig2 = _mm256_set1_ps(sig2);
+    const __m256 c24  = _mm256_set1_ps(24*eps);
+    const __m256 one  = _mm256_set1_ps(1.0f);
+    const __m256 two  = _mm256_set1_ps(2.0f);
+    const __m256i lane = _mm256_set_epi32(7,6,5,4,3,2,1,0);
+    const __m256 c4   = _mm256_set1_ps(4*eps);
+    const __m256 vc   = _mm256_set1_ps(potential_LJ(LJ_CUTOFF*LJ_CUTOFF*sig2,
+                                                    eps, sig2));
+    __m256 vsum = _mm256_setzero_ps();
+
+    memset(p->fx, 0, p->npad*sizeof(float));
+    memset(p->fy, 0, p->npad*sizeof(float));
+
+    for (int i = 0; i < n; ++i) {
+        __m256 xi = _mm256_set1_ps(p->x[i]);
+        __m256 yi = _mm256_set1_ps(p->y[i]);
+        __m256 fxi = _mm256_setzero_ps();
+        __m256 fyi = _mm256_setzero_ps();
+        int j0 = ((i+1)/8)*8;
+
+        for (int j = j0; j < p->npad; j += 8) {
+            __m256 dx = _mm256_sub_ps(_mm256_load_ps(p->x+j), xi);
+            __m256 dy = _mm256_sub_ps(_mm256_load_ps(p->y+j), yi);
+            __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+            __m256 m  = _mm256_and_ps(_mm256_cmp_ps(r2, rc2, _CMP_LT_OQ),
+                        _mm256_castsi256_ps(_mm256_cmpgt_epi32(
+                            _mm256_add_epi32(lane, _mm256_set1_epi32(j)),
+                            _mm256_set1_epi32(i))));
+            if (_mm256_movemask_ps(m) == 0)
+                continue;
+
+            __m256 y = _mm256_rcp_ps(r2);
+            y = _mm256_mul_ps(y, _mm256_fnmadd_ps(r2, y, two));
+            __m256 z = _mm256_mul_ps(vsig2, y);
+            __m256 u = _mm256_mul_ps(_mm256_mul_ps(z, z), z);
+            __m256 C = _mm256_mul_ps(_mm256_mul_ps(c24, y),
+                       _mm256_mul_ps(u, _mm256_fnmadd_ps(two, u, one)));
+            C = _mm256_and_ps(C, m);
+            if (pe)
+                vsum = _mm256_add_ps(vsum, _mm256_and_ps(m,
+                    _mm256_fmsub_ps(_mm256_mul_ps(c4, u),
+                                    _mm256_sub_ps(u, one), vc)));
+
+            __m256 cx = _mm256_mul_ps(C, dx);
+            __m256 cy = _mm256_mul_ps(C, dy);
+            fxi = _mm256_add_ps(fxi, cx);
+            fyi = _mm256_add_ps(fyi, cy);
+            _mm256_store_ps(p->fx+j, _mm256_sub_ps(_mm256_load_ps(p->fx+j), cx));
+            _mm256_store_ps(p->fy+j, _mm256_sub_ps(_mm256_load_ps(p->fy+j), cy));
+        }
+        p->fx[i] += hsum256(fxi);
+        p->fy[i] += hsum256(fyi);
+    }
+    if (pe)
+        *pe += hsum256(vsum);
+}
+
+#else
+
+void soa_LJ_forces(particles_soa_t* p, float eps, float sig2, double* pe)
+{
+    int n = p->n;
+    double v = 0;
+    memset(p->fx, 0, p->npad*sizeof(float));
+    memset(p->fy, 0, p->npad*sizeof(float));
+    for (int i = 0; i < n; ++i) {
+        for (int j = i+1; j < n; ++j) {
+            float dx = p->x[j]-p->x[i];
+            float dy = p->y[j]-p->y[i];
+            float r2 = dx*dx+dy*dy;
+            float C_LJ = compute_LJ_scalar(r2, eps, sig2);
+            p->fx[i] += (C_LJ*dx);
+            p->fy[i] += (C_LJ*dy);
+            p->fx[j] -= (C_LJ*dx);
+            p->fy[j] -= (C_LJ*dy);
+            if (pe)
+                v += potential_LJ_cut(r2, eps, sig2);
+        }
+    }
+    if (pe)
+        *pe += v;
+}
+
+#endif
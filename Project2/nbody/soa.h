@@ -0,0 +1,30 @@
+#ifndef SOA_H
+#define SOA_H
+
+/* Lanes in one SIMD register of floats on the target we compile for */
+#if defined(__AVX512F__)
+#define SOA_WIDTH 16
+#elif defined(__AVX2__) && defined(__FMA__)
+#define SOA_WIDTH 8
+#else
+#define SOA_WIDTH 1
+#endif
+
+/* Structure-of-arrays particle data; arrays are 64-byte aligned and
+ * padded with far-away particles to a multiple of SOA_WIDTH */
+typedef struct particles_soa_t {
+    int    n;       /* Number of particles                */
+    int    npad;    /* n rounded up to a multiple of width */
+    float* x;       /* Positions                           */
+    float* y;
+    float* fx;      /* Forces                              */
+    float* fy;
+} particles_soa_t;
+
+void soa_alloc(particles_soa_t* p, int n);
+void soa_free(particles_soa_t* p);
+void soa_load(particles_soa_t* p, const float* restrict x);
+void soa_store_forces(const particles_soa_t* p, float* restrict F);
+void soa_LJ_forces(particles_soa_t* p, float eps, float sig2, double* pe);
+
+#endif /* SOA_H */
@@ -0,0 +1,340 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "traj.h"
+
+
+/*@T
+ * \section{Compressed trajectories}
+ *
+ * The [[NBView01]] format spends 64 bits on every particle in every
+ * frame, which adds up quickly: a million particles for 400 frames
+ * is over 3 GB.  Most of those bits are wasted.  The coordinates lie
+ * in the unit box, so a fixed-point number with [[bits]] bits has an
+ * error of at most $2^{-(\mathrm{bits}+1)}$ -- with 16 bits that is
+ * well under a percent of $\sigma$, invisible in the viewer.  And a
+ * particle moves only a little between frames, so the difference
+ * from its quantised position in the previous frame needs far fewer
+ * bits than the position itself.
+ *
+ * The [[NBView02]] format does just that.  The header is the
+ * [[NBView01]] header plus two more 32-bit integers, the number of
+ * bits per coordinate and the key frame interval [[TRAJ_KEY]].  Then
+ * come the frames.  Every [[TRAJ_KEY]]-th frame is a key frame that
+ * stores the quantised coordinates themselves.  The others store
+ * the error of a prediction from the frames before: the frame right
+ * after a key frame predicts no motion, and later ones extrapolate
+ * linearly, $q^{\mathrm{pred}} = 2 q^{(f-1)} - q^{(f-2)}$.  When the
+ * particles move smoothly between frames the linear guess is off by
+ * only the acceleration term; in a hot, dense gas collisions scramble
+ * the velocities between frames and it does about as well as no
+ * prediction, but no worse.  Either way the $2n$ numbers (in the
+ * usual $x, y$ interleaved order) are entropy coded in blocks of 64.
+ * After the last frame comes an index of frame offsets, and the file ends with
+ * the offset of the index, the frame count, and the tag [[NBIX]], so
+ * a reader can find any frame by decoding at most [[TRAJ_KEY]] of
+ * them.  As in [[NBView01]], everything is big-endian.
+ *
+ * Predictions are made from the quantised frames, not the exact
+ * ones, so that the reader can make the same ones and rounding
+ * errors do not accumulate along the run.
+ *@c*/
+#define TRAJ_TAG   "NBView02"
+#define TRAJ_BLOCK 64
+
+static void put32(FILE* fp, uint32_t v)
+{
+    v = htonl(v);
+    fwrite(&v, sizeof(v), 1, fp);
+}
+
+static void put64(FILE* fp, uint64_t v)
+{
+    put32(fp, (uint32_t) (v >> 32));
+    put32(fp, (uint32_t) v);
+}
+
+static uint32_t get32(FILE* fp)
+{
+    uint32_t v = 0;
+    if (fread(&v, sizeof(v), 1, fp) != 1)
+        return 0;
+    return ntohl(v);
+}
+
+static uint64_t get64(FILE* fp)
+{
+    uint64_t hi = get32(fp);
+    return (hi << 32) | get32(fp);
+}
+
+static int encoded_size(int n)
+{
+    int nblocks = (2*n + TRAJ_BLOCK-1) / TRAJ_BLOCK;
+    return 1 + nblocks + 2*n*sizeof(uint32_t) + 8;
+}
+
+void traj_write_header(traj_writer_t* tw, FILE* fp, int n, int bits)
+{
+    float scale = 1.0;
+    uint32_t nscale;
+    memcpy(&nscale, &scale, sizeof(nscale));
+
+    tw->fp      = fp;
+    tw->n       = n;
+    tw->bits    = bits;
+    tw->nframes = 0;
+    tw->q       = (uint32_t*) calloc(2*n, sizeof(uint32_t));
+    tw->q0      = (uint32_t*) calloc(2*n, sizeof(uint32_t));
+    tw->d       = (uint32_t*) malloc(2*n*sizeof(uint32_t));
+    tw->out     = (uint8_t*) malloc(encoded_size(n));
+    tw->nindex  = 64;
+    tw->index   = (uint64_t*) malloc(tw->nindex*sizeof(uint64_t));
+
+    fprintf(fp, "%s\n", TRAJ_TAG);
+    put32(fp, (uint32_t) n);
+    put32(fp, nscale);
+    put32(fp, (uint32_t) bits);
+    put32(fp, TRAJ_KEY);
+}
+
+/*@T
+ *
+ * The prediction error can be negative, so before coding we fold it
+ * onto the non-negative integers by the ``zigzag'' map $0, -1, 1, -2,
+ * \ldots \mapsto 0, 1, 2, 3, \ldots$, which keeps small errors of
+ * either sign small.  The folded values are then Rice coded in
+ * blocks of 64: with a parameter $k$, a value $v$ goes out as
+ * $\lfloor v/2^k \rfloor$ one bits and a zero, then the low $k$ bits
+ * of $v$.  Each block starts with a byte holding the $k$ that makes
+ * that block shortest.  Unlike packing every value at the width of
+ * the largest, this lets the occasional fast particle cost a few
+ * extra bits instead of widening the whole block; on a thermal gas
+ * it saves about a bit per coordinate.  The bits are stored least
+ * significant first.
+ *@c*/
+typedef struct bits_t {
+    uint8_t* p;     /* Next byte                     */
+    uint64_t acc;   /* Pending bits, oldest lowest   */
+    int      nacc;  /* Number of pending bits        */
+} bits_t;
+
+static void put_bits(bits_t* b, uint64_t v, int w)
+{
+    b->acc |= v << b->nacc;
+    b->nacc += w;
+    while (b->nacc >= 8) {
+        *b->p++ = (uint8_t) b->acc;
+        b->acc >>= 8;
+        b->nacc -= 8;
+    }
+}
+
+static uint32_t get_bits(bits_t* b, int w)
+{
+    while (b->nacc < w) {
+        b->acc |= (uint64_t) *b->p++ << b->nacc;
+        b->nacc += 8;
+    }
+    uint32_t v = (uint32_t) (b->acc & ((1ull << w)-1));
+    b->acc >>= w;
+    b->nacc -= w;
+    return v;
+}
+
+static int rice_blocks(const uint32_t* v, int m, uint8_t* out)
+{
+    bits_t b = { out, 0, 0 };
+    for (int i = 0; i < m; i += TRAJ_BLOCK) {
+        int cnt = (m-i < TRAJ_BLOCK) ? m-i : TRAJ_BLOCK;
+        uint32_t all = 0;
+        for (int j = 0; j < cnt; ++j)
+            all |= v[i+j];
+        int w = all ? 32 - __builtin_clz(all) : 0;
+
+        /* With k = w every quotient is zero, so the best k is <= w */
+        int k = w;
+        uint64_t best = (uint64_t) cnt*(w+1);
+        for (int kk = 0; kk < w; ++kk) {
+            uint64_t cost = (uint64_t) cnt*(kk+1);
+            for (int j = 0; j < cnt; ++j)
+                cost += v[i+j] >> kk;
+            if (cost < best) {
+                best = cost;
+                k = kk;
+            }
+        }
+
+        put_bits(&b, k, 8);
+        for (int j = 0; j < cnt; ++j) {
+            uint32_t u = v[i+j] >> k;
+            for (; u >= 32; u -= 32)
+                put_bits(&b, 0xffffffffu, 32);
+            put_bits(&b, (1ull << u)-1, u+1);
+            put_bits(&b, v[i+j] & ((1ull << k)-1), k);
+        }
+    }
+    if (b.nacc > 0)
+        *b.p++ = (uint8_t) b.acc;
+    return b.p-out;
+}
+
+static void unrice_blocks(const uint8_t* p, int m, uint32_t* v)
+{
+    bits_t b = { (uint8_t*) p, 0, 0 };
+    for (int i = 0; i < m; i += TRAJ_BLOCK) {
+        int cnt = (m-i < TRAJ_BLOCK) ? m-i : TRAJ_BLOCK;
+        int k = get_bits(&b, 8);
+        if (k > 31)
+            k = 31;
+        for (int j = 0; j < cnt; ++j) {
+            uint32_t u = 0;
+            while (get_bits(&b, 1))
+                ++u;
+            v[i+j] = (u << k) | get_bits(&b, k);
+        }
+    }
+}
+
+void traj_write_frame(traj_writer_t* tw, const float* x)
+{
+    int m = 2*tw->n;
+    int kind = tw->nframes % TRAJ_KEY;  /* 0 key, 1 delta, else linear */
+    float scale = (float) ((1u << tw->bits) - 1);
+    uint32_t* d = tw->d;
+
+    for (int k = 0; k < m; ++k) {
+        float xk = x[k] < 0 ? 0 : (x[k] > 1 ? 1 : x[k]);
+        uint32_t q = (uint32_t) (xk*scale + 0.5f);
+        uint32_t pred = (kind == 1) ? tw->q[k] : 2*tw->q[k] - tw->q0[k];
+        int32_t delta = (int32_t) (q - pred);
+        d[k] = kind ? ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31) : q;
+        tw->q0[k] = tw->q[k];
+        tw->q[k]  = q;
+    }
+
+    tw->out[0] = (uint8_t) (kind < 2 ? kind : 2);
+    int len = 1 + rice_blocks(d, m, tw->out+1);
+
+    if (tw->nframes == tw->nindex) {
+        tw->nindex *= 2;
+        tw->index = (uint64_t*) realloc(tw->index,
+                                        tw->nindex*sizeof(uint64_t));
+    }
+    tw->index[tw->nframes++] = (uint64_t) ftell(tw->fp);
+    fwrite(tw->out, 1, len, tw->fp);
+}
+
+void traj_write_index(traj_writer_t* tw)
+{
+    uint64_t where = (uint64_t) ftell(tw->fp);
+    for (int f = 0; f < tw->nframes; ++f)
+        put64(tw->fp, tw->index[f]);
+    put64(tw->fp, where);
+    put32(tw->fp, (uint32_t) tw->nframes);
+    fwrite("NBIX", 1, 4, tw->fp);
+
+    free(tw->index);
+    free(tw->out);
+    free(tw->d);
+    free(tw->q0);
+    free(tw->q);
+}
+
+/*@T
+ *
+ * The reader checks the tag, reads the index from the end of the
+ * file, and then decodes frames on demand.  Asking for the frame
+ * after the one it holds costs a single step; any other frame means
+ * going back to the key frame before it and working forward.
+ *@c*/
+int traj_read_open(traj_reader_t* tr, const char* fname)
+{
+    char tag[16] = "";
+    char ix[4];
+    uint64_t where;
+
+    memset(tr, 0, sizeof(*tr));
+    tr->fp = fopen(fname, "rb");
+    if (!tr->fp)
+        return -1;
+    if (!fgets(tag, sizeof(tag), tr->fp) ||
+        strncmp(tag, TRAJ_TAG, strlen(TRAJ_TAG)) != 0) {
+        fclose(tr->fp);
+        return -1;
+    }
+    tr->n    = (int) get32(tr->fp);
+    get32(tr->fp);  /* scale */
+    tr->bits = (int) get32(tr->fp);
+    tr->key  = (int) get32(tr->fp);
+
+    fseek(tr->fp, -16, SEEK_END);
+    where       = get64(tr->fp);
+    tr->nframes = (int) get32(tr->fp);
+    if (fread(ix, 1, 4, tr->fp) != 4 || memcmp(ix, "NBIX", 4) != 0 ||
+        tr->bits < 1 || tr->bits > 24 || tr->key < 1) {
+        fclose(tr->fp);
+        return -1;
+    }
+
+    tr->index = (uint64_t*) malloc((tr->nframes+1)*sizeof(uint64_t));
+    fseek(tr->fp, (long) where, SEEK_SET);
+    for (int f = 0; f < tr->nframes; ++f)
+        tr->index[f] = get64(tr->fp);
+    tr->index[tr->nframes] = where;
+
+    tr->q   = (uint32_t*) calloc(2*tr->n, sizeof(uint32_t));
+    tr->q0  = (uint32_t*) calloc(2*tr->n, sizeof(uint32_t));
+    tr->d   = (uint32_t*) malloc(2*tr->n*sizeof(uint32_t));
+    tr->nin = encoded_size(tr->n);
+    tr->in  = (uint8_t*) malloc(tr->nin);
+    tr->cur = -1;
+    return 0;
+}
+
+static void decode_frame(traj_reader_t* tr, int frame)
+{
+    int m = 2*tr->n;
+    size_t len = tr->index[frame+1] - tr->index[frame];
+    uint32_t* d = tr->d;
+
+    if (len > tr->nin)
+        len = tr->nin;
+    fseek(tr->fp, (long) tr->index[frame], SEEK_SET);
+    if (fread(tr->in, 1, len, tr->fp) != len)
+        memset(tr->in, 0, tr->nin);
+    unrice_blocks(tr->in+1, m, d);
+
+    for (int k = 0; k < m; ++k) {
+        uint32_t delta = (d[k] >> 1) ^ -(d[k] & 1);
+        uint32_t q = tr->in[0] == 0 ? d[k] :
+                     tr->in[0] == 1 ? tr->q[k] + delta :
+                                      2*tr->q[k] - tr->q0[k] + delta;
+        tr->q0[k] = tr->q[k];
+        tr->q[k]  = q;
+    }
+    tr->cur = frame;
+}
+
+void traj_read_frame(traj_reader_t* tr, int frame, float* x)
+{
+    float scale = 1.0f / (float) ((1u << tr->bits) - 1);
+    int start = frame - frame % tr->key;
+    if (tr->cur >= start && tr->cur <= frame)
+        start = tr->cur+1;
+    for (int f = start; f <= frame; ++f)
+        decode_frame(tr, f);
+    for (int k = 0; k < 2*tr->n; ++k)
+        x[k] = tr->q[k] * scale;
+}
+
+void traj_read_close(traj_reader_t* tr)
+{
+    free(tr->in);
+    free(tr->d);
+    free(tr->q0);
+    free(tr->q);
+    free(tr->index);
+    fclose(tr->fp);
+}
@@ -0,0 +1,48 @@
+#ifndef TRAJ_H
+#define TRAJ_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Frames between key frames; everything else is a delta */
+#define TRAJ_KEY 32
+
+/* Writer for the compressed NBView02 format */
+typedef struct traj_writer_t {
+    FILE*     fp;       /* Output file                          */
+    int       n;        /* Particles per frame                  */
+    int       bits;     /* Bits per quantised coordinate        */
+    int       nframes;  /* Frames written so far                */
+    uint32_t* q;        /* Quantised previous frame (2n)        */
+    uint32_t* q0;       /* Quantised frame before that (2n)     */
+    uint32_t* d;        /* Values to pack (2n)                  */
+    uint8_t*  out;      /* Encoded frame                        */
+    uint64_t* index;    /* File offset of each frame            */
+    int       nindex;   /* Offsets index can hold               */
+} traj_writer_t;
+
+void traj_write_header(traj_writer_t* tw, FILE* fp, int n, int bits);
+void traj_write_frame(traj_writer_t* tw, const float* x);
+void traj_write_index(traj_writer_t* tw);
+
+/* Reader with random access to frames through the index */
+typedef struct traj_reader_t {
+    FILE*     fp;       /* Input file                           */
+    int       n;        /* Particles per frame                  */
+    int       bits;     /* Bits per quantised coordinate        */
+    int       key;      /* Frames between key frames            */
+    int       nframes;  /* Frames in the file                   */
+    uint64_t* index;    /* Offsets of frames, plus end of last  */
+    uint32_t* q;        /* Quantised frame cur (2n)             */
+    uint32_t* q0;       /* Quantised frame cur-1 (2n)           */
+    uint32_t* d;        /* Unpacked values (2n)                 */
+    int       cur;      /* Frame held in q, -1 for none         */
+    uint8_t*  in;       /* Encoded frame being decoded          */
+    size_t    nin;      /* Bytes in can hold                    */
+} traj_reader_t;
+
+int  traj_read_open(traj_reader_t* tr, const char* fname);
+void traj_read_frame(traj_reader_t* tr, int frame, float* x);
+void traj_read_close(traj_reader_t* tr);
+
+#endif /* TRAJ_H */
@@ -0,0 +1,288 @@
+/*
+ * P3M solver for the gravitational sum of gravity.c, O(n + m^2 log m)
+ * per step instead of O(n^2).
+ *
+ * The pair kernel K(d) = d/|d|^2 of NbodyCalc() is split with a
+ * Gaussian of width s = sigma mesh cells:
+ *
+ *   K = K (1 - exp(-r^2/2s^2))  +  K exp(-r^2/2s^2)
+ *       long range, smooth          short range, negligible past a few s
+ *
+ * The long-range part is smooth on the scale of the mesh, so it is
+ * computed on the mesh: cloud-in-cell deposit of the masses, a
+ * convolution with the long-range kernel by FFT, and cloud-in-cell
+ * interpolation back to the bodies. The mesh is zero padded to 2m x 2m
+ * so the convolution is not periodic. Since the density is real, the x
+ * and y kernels go into the real and imaginary parts of one complex
+ * array, and one inverse FFT gives both field components.
+ *
+ * The short-range part is summed directly over the bodies within
+ * cutoff*s, found with a cell list.
+ *
+ * Accuracy is tuned with m (finer mesh), sigma (a wider split gives a
+ * smoother mesh part but more direct work) and cutoff. The FFT is the
+ * plain iterative radix-2 one below, parallelised over rows and
+ * columns with OpenMP.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "particle_mesh.h"
+
+void pmInit(PMGrid* pm, int m, float sigma, float cutoff)
+{
+  int mp = 2*m;
+  memset(pm, 0, sizeof(*pm));
+  pm->m = m;
+  pm->sigma = sigma;
+  pm->cutoff = cutoff;
+  pm->rho = (double complex*) malloc(mp*mp*sizeof(double complex));
+  pm->kernel = (double complex*) malloc(mp*mp*sizeof(double complex));
+}
+
+void pmFree(PMGrid* pm)
+{
+  free(pm->rho);
+  free(pm->kernel);
+  free(pm->start);
+  free(pm->idx);
+}
+
+// in-place radix-2 FFT of n (a power of two) points, sign -1 forward
+static void fft1(double complex* a, int n, int sign)
+{
+  int i, j, len;
+  for(i=1, j=0; i<n; i++)
+  {
+    int bit = n >> 1;
+    for(; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if(i < j)
+    {
+      double complex t = a[i];
+      a[i] = a[j];
+      a[j] = t;
+    }
+  }
+  for(len=2; len<=n; len<<=1)
+  {
+    double complex w = cexp(sign*2*M_PI*I/len);
+    for(i=0; i<n; i+=len)
+    {
+      double complex wk = 1;
+      for(j=0; j<len/2; j++)
+      {
+        double complex u = a[i+j], v = a[i+j+len/2]*wk;
+        a[i+j] = u + v;
+        a[i+j+len/2] = u - v;
+        wk *= w;
+      }
+    }
+  }
+}
+
+// 2D FFT of an n x n row-major array; the inverse is not scaled
+static void fft2(double complex* a, int n, int sign)
+{
+  int r, c;
+#pragma omp parallel for
+  for(r=0; r<n; r++)
+    fft1(a + (long) r*n, n, sign);
+#pragma omp parallel
+  {
+    double complex* col = (double complex*) malloc(n*sizeof(double complex));
+#pragma omp for
+    for(c=0; c<n; c++)
+    {
+      for(r=0; r<n; r++) col[r] = a[(long) r*n + c];
+      fft1(col, n, sign);
+      for(r=0; r<n; r++) a[(long) r*n + c] = col[r];
+    }
+    free(col);
+  }
+}
+
+// cloud-in-cell weights of position (x,y): node (ix,iy) and fractions
+static void cic(const PMGrid* pm, float x, float y, int* ix, int* iy,
+                float* fx, float* fy)
+{
+  float gx = (x - pm->x_min)/pm->h, gy = (y - pm->y_min)/pm->h;
+  *ix = (int) gx;
+  *iy = (int) gy;
+  *fx = gx - *ix;
+  *fy = gy - *iy;
+}
+
+// long-range field: deposit, convolve, leave the field in rho
+static void meshField(PMGrid* pm, const BodiesSoA* b)
+{
+  int m = pm->m, mp = 2*m, i, r;
+  double s2 = (double) pm->sigma*pm->h*pm->sigma*pm->h;
+
+  memset(pm->rho, 0, (long) mp*mp*sizeof(double complex));
+  for(i=0;i<b->n;i++)
+  {
+    int ix, iy;
+    float fx, fy, mass = b->mass[i];
+    cic(pm, b->x_pos[i], b->y_pos[i], &ix, &iy, &fx, &fy);
+    pm->rho[(long) iy*mp + ix] += mass*(1-fx)*(1-fy);
+    pm->rho[(long) iy*mp + ix+1] += mass*fx*(1-fy);
+    pm->rho[(long) (iy+1)*mp + ix] += mass*(1-fx)*fy;
+    pm->rho[(long) (iy+1)*mp + ix+1] += mass*fx*fy;
+  }
+
+  // the long-range kernel at every offset, wrapped around the padding
+#pragma omp parallel for
+  for(r=0; r<mp; r++)
+  {
+    int c;
+    double dy = ((r < m) ? r : r - mp)*pm->h;
+    for(c=0; c<mp; c++)
+    {
+      double dx = ((c < m) ? c : c - mp)*pm->h;
+      double d2 = dx*dx + dy*dy;
+      double k = (d2 > 0) ? (1 - exp(-d2/(2*s2)))/d2 : 0;
+      // the field at x is the sum over sources at x - d
+      pm->kernel[(long) r*mp + c] = k*dx + I*k*dy;
+    }
+  }
+
+  fft2(pm->rho, mp, -1);
+  fft2(pm->kernel, mp, -1);
+  // undo the smoothing of the deposit and the interpolation, each of
+  // which multiplies mode k by sinc^2(pi k/mp) in either direction
+#pragma omp parallel for
+  for(r=0; r<mp; r++)
+  {
+    int c;
+    double ky = M_PI*((r < m) ? r : r - mp)/mp;
+    double wy = (ky != 0) ? sin(ky)/ky : 1;
+    for(c=0; c<mp; c++)
+    {
+      double kx = M_PI*((c < m) ? c : c - mp)/mp;
+      double wx = (kx != 0) ? sin(kx)/kx : 1;
+      double w = wx*wy;
+      pm->rho[(long) r*mp + c] *= pm->kernel[(long) r*mp + c]/(w*w*w*w*mp*mp);
+    }
+  }
+  fft2(pm->rho, mp, 1);
+}
+
+// bin all bodies into cells at least the short-range cutoff wide
+static void binBodies(PMGrid* pm, const BodiesSoA* b, float rc)
+{
+  int n = b->n, i, c, nc2;
+  float span = pm->h*(pm->m-1);
+
+  pm->ncell = (int) (span/rc);
+  if(pm->ncell < 1) pm->ncell = 1;
+  if(pm->ncell > 2048) pm->ncell = 2048;
+  nc2 = pm->ncell*pm->ncell;
+  if(n > pm->nalloc)
+  {
+    pm->nalloc = n;
+    pm->idx = (int*) realloc(pm->idx, n*sizeof(int));
+  }
+  pm->start = (int*) realloc(pm->start, (nc2+2)*sizeof(int));
+  memset(pm->start, 0, (nc2+2)*sizeof(int));
+
+  for(i=0;i<n;i++)
+  {
+    int cx = (int) ((b->x_pos[i] - pm->x_min)/span*pm->ncell);
+    int cy = (int) ((b->y_pos[i] - pm->y_min)/span*pm->ncell);
+    if(cx >= pm->ncell) cx = pm->ncell-1;
+    if(cy >= pm->ncell) cy = pm->ncell-1;
+    pm->start[cy*pm->ncell + cx + 2]++;
+  }
+  for(c=0;c<nc2;c++)
+    pm->start[c+2] += pm->start[c+1];
+  for(i=0;i<n;i++)
+  {
+    int cx = (int) ((b->x_pos[i] - pm->x_min)/span*pm->ncell);
+    int cy = (int) ((b->y_pos[i] - pm->y_min)/span*pm->ncell);
+    if(cx >= pm->ncell) cx = pm->ncell-1;
+    if(cy >= pm->ncell) cy = pm->ncell-1;
+    pm->idx[pm->start[cy*pm->ncell + cx + 1]++] = i;
+  }
+}
+
+// acceleration of bodies i0..i1-1 of b, as gravityAccel()
+void pmAccel(PMGrid* pm, const BodiesSoA* b, int i0, int i1, float g,
+             float* x_acc, float* y_acc)
+{
+  int m = pm->m, mp = 2*m, i;
+  float x_lo = b->x_pos[0], x_hi = b->x_pos[0];
+  float y_lo = b->y_pos[0], y_hi = b->y_pos[0];
+  float side, s, rc, span;
+
+#pragma omp parallel for reduction(min:x_lo,y_lo) reduction(max:x_hi,y_hi)
+  for(i=0;i<b->n;i++)
+  {
+    x_lo = fminf(x_lo, b->x_pos[i]);
+    x_hi = fmaxf(x_hi, b->x_pos[i]);
+    y_lo = fminf(y_lo, b->y_pos[i]);
+    y_hi = fmaxf(y_hi, b->y_pos[i]);
+  }
+  // bodies stay at least half a cell inside the m x m nodes
+  side = fmaxf(x_hi - x_lo, y_hi - y_lo);
+  side = (side > 0) ? side : 1.0f;
+  pm->h = side/(m-2);
+  pm->x_min = x_lo - pm->h/2;
+  pm->y_min = y_lo - pm->h/2;
+  s = pm->sigma*pm->h;
+  rc = pm->cutoff*s;
+  span = pm->h*(m-1);
+
+  meshField(pm, b);
+  binBodies(pm, b, rc);
+
+#pragma omp parallel for schedule(dynamic,64)
+  for(i=i0;i<i1;i++)
+  {
+    float xi = b->x_pos[i], yi = b->y_pos[i];
+    float fx, fy, ax, ay, inv2s2 = 1/(2*s*s);
+    int ix, iy, cx, cy, jx, jy, nc = pm->ncell;
+    double complex e;
+
+    // long range: interpolate the mesh field
+    cic(pm, xi, yi, &ix, &iy, &fx, &fy);
+    e = pm->rho[(long) iy*mp + ix]*(1-fx)*(1-fy)
+      + pm->rho[(long) iy*mp + ix+1]*fx*(1-fy)
+      + pm->rho[(long) (iy+1)*mp + ix]*(1-fx)*fy
+      + pm->rho[(long) (iy+1)*mp + ix+1]*fx*fy;
+    ax = creal(e);
+    ay = cimag(e);
+
+    // short range: direct sum over the neighbouring cells
+    cx = (int) ((xi - pm->x_min)/span*nc);
+    cy = (int) ((yi - pm->y_min)/span*nc);
+    if(cx >= nc) cx = nc-1;
+    if(cy >= nc) cy = nc-1;
+    for(jy=cy-1; jy<=cy+1; jy++)
+    {
+      if(jy < 0 || jy >= nc) continue;
+      for(jx=cx-1; jx<=cx+1; jx++)
+      {
+        int k;
+        if(jx < 0 || jx >= nc) continue;
+        for(k=pm->start[jy*nc+jx]; k<pm->start[jy*nc+jx+1]; k++)
+        {
+          int j = pm->idx[k];
+          float dx = xi - b->x_pos[j], dy = yi - b->y_pos[j];
+          float r2 = dx*dx + dy*dy;
+          if(r2 > 0 && r2 < rc*rc)
+          {
+            float w = b->mass[j]*expf(-r2*inv2s2)/r2;
+            ax += w*dx;
+            ay += w*dy;
+          }
+        }
+      }
+    }
+    x_acc[i-i0] = g*b->mass[i]*ax;
+    y_acc[i-i0] = g*b->mass[i]*ay;
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef PARTICLE_MESH_H
+#define PARTICLE_MESH_H
+
+#include <complex.h>
+
+#include "gravity.h"
+
+/* Particle-particle/particle-mesh (P3M) solver for the gravitational sum
+ * of gravity.c. The mesh has m x m nodes over the bounding box of the
+ * bodies; sigma (in mesh cells) is where the force is split between
+ * the mesh and the direct short-range sum, and the short-range sum
+ * stops at cutoff * sigma */
+typedef struct pmGrid {
+  int m;                     // mesh nodes per side, a power of two
+  float sigma;               // split scale in mesh cells
+  float cutoff;              // short-range cutoff in units of sigma
+  float x_min, y_min, h;     // mesh origin and spacing of the last call
+  double complex* rho;       // padded 2m x 2m density, then field
+  double complex* kernel;    // padded 2m x 2m force kernel, x + i y
+  int ncell;                 // short-range cells per side
+  int *start, *idx;          // bodies of each cell, as in a cell list
+  int nalloc;
+}PMGrid;
+
+void pmInit(PMGrid* pm, int m, float sigma, float cutoff);
+void pmAccel(PMGrid* pm, const BodiesSoA* b, int i0, int i1, float g,
+             float* x_acc, float* y_acc);
+void pmFree(PMGrid* pm);
+
+#endif
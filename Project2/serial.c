@@ -19,6 +19,8 @@
 #include <errno.h>
 #include <string.h>
 
+#include "philox.h"
+
 #define EPS	      1
 #define SIG	      1e-2
 #define CUT	      2.5
@@ -55,14 +57,23 @@ typedef struct molecule {
 }mols;
 
 
+// Random numbers come from Philox (common/philox.h): the rejection
+// sampling of positions reads one stream in order, and particle i's
+// velocity is element i of another
+#define SEED 1
+#define STREAM_POS 1
+#define STREAM_VEL 2
+
 int init_particles(int n, float* x, float* v, params* param)
 {
+    philox_stream_t rng;
     float sig = param->sig_lj;
     float min_r2 = sig*sig;
 
     float r2,dx,dy,dz;
     int i,j,trial;
 
+    philox_stream_init(&rng, SEED, STREAM_POS);
     for(i = 0; i < n; i++)
     {
 	r2 = 0;	
@@ -70,9 +81,9 @@ int init_particles(int n, float* x, float* v, params* param)
 	/* Choose new point via rejection sampling */
 	for(trial = 0; (trial < MAX_TRIALS) && (r2 < min_r2); trial++)
 	{
-	    x[3*i] = (float) (BOX_SIZE*drand48()) - BOX_SIZE/2.0;
-	    x[3*i+1] = (float) (BOX_SIZE*drand48()) - BOX_SIZE/2.0;
-	    x[3*i+2] = (float) (BOX_SIZE*drand48()) - BOX_SIZE/2.0;
+	    x[3*i] = (float) (BOX_SIZE*philox_next_u01(&rng)) - BOX_SIZE/2.0;
+	    x[3*i+1] = (float) (BOX_SIZE*philox_next_u01(&rng)) - BOX_SIZE/2.0;
+	    x[3*i+2] = (float) (BOX_SIZE*philox_next_u01(&rng)) - BOX_SIZE/2.0;
 
 	    for(j=0; j < i; j++)
 	    {
@@ -99,8 +110,9 @@ void init_particles_va(int n, float* v,float* a, params* param)
 
     for(i=0; i < n; i++)
     {
-	R = T0 * sqrt(-2.0 * log(drand48()));
-	T = 2 * PI * drand48();
+	philox4x32_t r = philox4x32(SEED, STREAM_VEL, i);
+	R = T0 * sqrt(-2.0 * log(1 - philox_u01(r.v[0], r.v[1])));
+	T = 2 * PI * philox_u01(r.v[2], r.v[3]);
 	v[3*i] = (R * cos(T));
 	v[3*i+1] = (R * sin(T));
 	v[3*i+2] = (R * sin(T));
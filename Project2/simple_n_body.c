@@ -4,6 +4,18 @@
  * baseline. We will need to look at units to make sure that all
  * units align well. I suggest using metric.
  *
+ * The same step is also available on a structure-of-arrays copy of the
+ * bodies with SIMD kernels (gravity.c), and with a Barnes-Hut tree code
+ * (barnes_hut.c) whose opening angle theta trades accuracy for speed,
+ * and with a P3M mesh solver (particle_mesh.c) on an m x m mesh.
+ * Build and run with
+ *
+ *   gcc -O3 -march=native -fopenmp -I../common -o nbody simple_n_body.c \
+ *       gravity.c barnes_hut.c particle_mesh.c -lm
+ *   ./nbody [number of bodies] [aos|soa|bh|pm] [theta|m]
+ *
+ * The tree and mesh codes also report their error against the direct
+ * sum.
  * */
 
 #include <stdio.h>
@@ -11,12 +23,21 @@
 #include <time.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+
+#include "philox.h"
+#include "gravity.h"
+#include "barnes_hut.h"
+#include "particle_mesh.h"
 
 
 #define G             6.67384E-11
 #define PI            3.14159265
 #define DT	      0.001           //  0.001 second time increments
 #define N_BODY_NUM    12800
+#define N_CHECK       1000            //  bodies checked against the direct sum
+#define PM_SIGMA      2.0             //  P3M force split, in mesh cells
+#define PM_CUTOFF     4.5             //  P3M short-range cutoff, in PM_SIGMA
 
 typedef float data_t;
 
@@ -39,28 +60,33 @@ inline data_t invDistance(Body* body1, Body* body2)
       (body1->y_pos-body2->y_pos)*(body1->y_pos-body2->y_pos));
 }
 
-data_t fRand(float,float,int);
+// Body i takes its mass, position and velocity from element i of two
+// Philox streams (common/philox.h), so the bodies can be drawn in
+// parallel and come out the same however the work is split
+#define BODY_SEED 12827467
+
+data_t fRand(float,float,uint32_t);
 
 int initBodies(Body* bodies, int Num)
 {
-  // Initialize all of the bodies
-  int i,mult=12827467;
+  int i;
+#pragma omp parallel for
   for(i=0; i< Num; i++)
   {
-    bodies[i].mass = fRand(100000.0,-100000.0,i);
-    bodies[i].x_pos = fRand(10,-10,i+mult);
-    bodies[i].y_pos = fRand(10,-10,i+2*mult);
-    bodies[i].x_vel = fRand(10,-10,i+3*mult);
-    bodies[i].y_vel = fRand(10,-10,i+4*mult);
-    mult+=81722171%192323820820392;
+    philox4x32_t r = philox4x32(BODY_SEED, 0, i);
+    philox4x32_t s = philox4x32(BODY_SEED, 1, i);
+    bodies[i].mass = fRand(100000.0,-100000.0,r.v[0]);
+    bodies[i].x_pos = fRand(10,-10,r.v[1]);
+    bodies[i].y_pos = fRand(10,-10,r.v[2]);
+    bodies[i].x_vel = fRand(10,-10,r.v[3]);
+    bodies[i].y_vel = fRand(10,-10,s.v[0]);
   }
-
+  return Num;
 }
 
-data_t fRand(float max, float min, int seed)     // need to iterate over seed key or else same result
+data_t fRand(float max, float min, uint32_t w)
 {
-  srand(seed);
-  return (data_t) (min + ((float)(rand()/(float)RAND_MAX)*(float)(max-min)));
+  return (data_t) (min + philox_f01(w)*(max-min));
 }
 
 
@@ -99,6 +125,31 @@ void NbodyCalc(Body* bodyArr, int totalNum)
   }
 }
 
+// One NbodyCalc() step on the structure-of-arrays copy of the bodies
+void NbodyCalcSoA(BodiesSoA* soa, data_t* x_acc, data_t* y_acc)
+{
+  gravityAccel(soa, 0, soa->n, G, x_acc, y_acc);
+  gravityUpdate(soa, 0, soa->n, DT, x_acc, y_acc);
+}
+
+// Accelerations from the tree, before the update
+void NbodyAccelBH(BodiesSoA* soa, BHTree* tree, data_t theta,
+                  data_t* x_acc, data_t* y_acc)
+{
+  bhBuild(tree, soa, theta);
+  bhAccel(tree, soa, 0, soa->n, G, x_acc, y_acc);
+}
+
+// Error of the approximate accelerations of the first few bodies
+void reportError(BodiesSoA* soa, data_t* x_acc, data_t* y_acc)
+{
+  int nc = (soa->n < N_CHECK) ? soa->n : N_CHECK;
+  double rms, worst;
+  gravityError(soa, 0, nc, G, x_acc, y_acc, &rms, &worst);
+  printf("Relative error over %d bodies: rms %.3e, worst %.3e\n",
+         nc, rms, worst);
+}
+
 struct timespec diff(struct timespec start, struct timespec end)
 {
   struct timespec temp;
@@ -112,24 +163,90 @@ struct timespec diff(struct timespec start, struct timespec end)
   return temp;
 }
 
-int main()
+int main(int argc, char **argv)
 {
 
   struct timespec diff(struct timespec start, struct timespec end);
   struct timespec time1, time2;
   struct timespec time_stamp;
 
-  Body b[N_BODY_NUM];
-  int i,j;
-  int numBod = N_BODY_NUM;
-  srand(time(NULL));
+  int i;
+  int numBod = (argc > 1) ? atoi(argv[1]) : N_BODY_NUM;
+  const char* method = (argc > 2) ? argv[2] : "aos";
+  data_t theta = (argc > 3) ? atof(argv[3]) : 0.5;
+  int mesh = (argc > 3) ? atoi(argv[3]) : 256;
+  if(strcmp(method, "aos") != 0 && strcmp(method, "soa") != 0 &&
+     strcmp(method, "bh") != 0 && strcmp(method, "pm") != 0)
+  {
+    fprintf(stderr, "unknown method %s (aos, soa, bh or pm)\n", method);
+    return 1;
+  }
+  Body* b = (Body*) malloc(numBod*sizeof(Body));
   initBodies(b,numBod);
 
-  clock_gettime(CLOCK_REALTIME, &time1);
+  if(strcmp(method, "aos") != 0)
+  {
+    BodiesSoA soa;
+    data_t* x_acc = (data_t*) malloc(numBod*sizeof(data_t));
+    data_t* y_acc = (data_t*) malloc(numBod*sizeof(data_t));
+    bodiesAlloc(&soa,numBod);
+    for(i=0;i<numBod;i++)
+    {
+      soa.mass[i] = b[i].mass;
+      soa.x_pos[i] = b[i].x_pos;
+      soa.y_pos[i] = b[i].y_pos;
+      soa.x_vel[i] = b[i].x_vel;
+      soa.y_vel[i] = b[i].y_vel;
+    }
+
+    if(strcmp(method, "bh") == 0 || strcmp(method, "pm") == 0)
+    {
+      // time the step without the error check in the middle
+      struct timespec time3, time4;
+      BHTree tree;
+      PMGrid pm;
+      bhInit(&tree);
+      if(strcmp(method, "pm") == 0)
+        pmInit(&pm, mesh, PM_SIGMA, PM_CUTOFF);
+      clock_gettime(CLOCK_REALTIME, &time1);
+      if(strcmp(method, "pm") == 0)
+        pmAccel(&pm, &soa, 0, numBod, G, x_acc, y_acc);
+      else
+        NbodyAccelBH(&soa,&tree,theta,x_acc,y_acc);
+      clock_gettime(CLOCK_REALTIME, &time2);
+      reportError(&soa,x_acc,y_acc);
+      clock_gettime(CLOCK_REALTIME, &time3);
+      gravityUpdate(&soa, 0, numBod, DT, x_acc, y_acc);
+      clock_gettime(CLOCK_REALTIME, &time4);
+      time_stamp = diff(time3,time4);
+      time2.tv_sec += time_stamp.tv_sec;
+      time2.tv_nsec += time_stamp.tv_nsec;
+      bhFree(&tree);
+      if(strcmp(method, "pm") == 0)
+        pmFree(&pm);
+    }
+    else
+    {
+      clock_gettime(CLOCK_REALTIME, &time1);
 
-  NbodyCalc(b,numBod);
+      NbodyCalcSoA(&soa,x_acc,y_acc);
 
-  clock_gettime(CLOCK_REALTIME, &time2);
+      clock_gettime(CLOCK_REALTIME, &time2);
+    }
+
+    bodiesFree(&soa);
+    free(x_acc);
+    free(y_acc);
+  }
+  else
+  {
+    clock_gettime(CLOCK_REALTIME, &time1);
+
+    NbodyCalc(b,numBod);
+
+    clock_gettime(CLOCK_REALTIME, &time2);
+  }
+  free(b);
 
   time_stamp = diff(time1,time2);
   printf("Execution time: %lf\n",(double)((time_stamp.tv_sec + (time_stamp.tv_nsec/1.0e9))));
@@ -12,6 +12,8 @@
 #include <stdlib.h>
 // #include <errno.h>
 
+#include "philox.h"
+
 
 #define G             6.67384E-11
 #define PI            3.14159265
@@ -43,30 +45,34 @@ inline data_t invDistance(Body* body1, Body* body2)
       (body1->y_pos-body2->y_pos)*(body1->y_pos-body2->y_pos));
 }
 
-data_t fRand(float,float,int);
+// Body i takes its mass, position and velocity from element i of two
+// Philox streams (common/philox.h), the same bodies simple_n_body.c
+// and hybrid2.c draw
+#define BODY_SEED 12827467
+
+data_t fRand(float,float,uint32_t);
 
 int initBodies(Body* bodies, int Num)
 {
-  // Initialize all of the bodies
-  int i,mult=12827467;
+  int i;
   for(i=0; i< Num; i++)
   {
-    bodies[i].mass = fRand(100000.0,-100000.0,i);
-    bodies[i].x_pos = fRand(10,-10,i+mult);
-    bodies[i].y_pos = fRand(10,-10,i+2*mult);
-    bodies[i].x_vel = fRand(10,-10,i+3*mult);
-    bodies[i].y_vel = fRand(10,-10,i+4*mult);
-    mult+=81722171%192323820820392;
+    philox4x32_t r = philox4x32(BODY_SEED, 0, i);
+    philox4x32_t s = philox4x32(BODY_SEED, 1, i);
+    bodies[i].mass = fRand(100000.0,-100000.0,r.v[0]);
+    bodies[i].x_pos = fRand(10,-10,r.v[1]);
+    bodies[i].y_pos = fRand(10,-10,r.v[2]);
+    bodies[i].x_vel = fRand(10,-10,r.v[3]);
+    bodies[i].y_vel = fRand(10,-10,s.v[0]);
   }
+  return Num;
 }
 
-data_t fRand(float max, float min, int seed)     
+data_t fRand(float max, float min, uint32_t w)
 {
-  srand(seed);
-  return (data_t) (min + ((float)(rand()/(float)RAND_MAX)*(float)(max-min)));
+  return (data_t) (min + philox_f01(w)*(max-min));
 }
 
-
 int findmyrange(int n, int nth, int me)
 {
   int chunksize = n / nth;
@@ -0,0 +1,142 @@
+#ifndef PHILOX_H
+#define PHILOX_H
+
+/*
+ * Philox4x32-10 counter-based random numbers (Salmon, Moraes, Dror and
+ * Shaw, "Parallel random numbers: as easy as 1, 2, 3", SC'11).
+ *
+ * The output is a pure function of a key (the run's seed) and a
+ * counter, so element i of a random array can be generated directly
+ * by whichever thread or rank owns it, with no shared state and no
+ * need to draw elements 0 to i-1 first.  A run gives the same numbers
+ * however the work is divided.  The counter is split into a 64-bit
+ * stream, naming what the numbers are for, and a 64-bit index within
+ * that stream.
+ *
+ * Header only: include it and compile with -I pointing at this
+ * directory.
+ */
+
+#include <stdint.h>
+
+typedef struct philox4x32_t {
+    uint32_t v[4];
+} philox4x32_t;
+
+static inline uint32_t philox_mulhilo(uint32_t a, uint32_t b, uint32_t* hi)
+{
+    uint64_t p = (uint64_t) a * b;
+    *hi = (uint32_t) (p >> 32);
+    return (uint32_t) p;
+}
+
+/* Four random words for element i of the given stream */
+static inline philox4x32_t philox4x32(uint64_t seed, uint64_t stream,
+                                      uint64_t i)
+{
+    uint32_t c0 = (uint32_t) i,      c1 = (uint32_t) (i >> 32);
+    uint32_t c2 = (uint32_t) stream, c3 = (uint32_t) (stream >> 32);
+    uint32_t k0 = (uint32_t) seed,   k1 = (uint32_t) (seed >> 32);
+    philox4x32_t r;
+
+    for (int round = 0; round < 10; ++round) {
+        uint32_t hi0, hi1;
+        uint32_t lo0 = philox_mulhilo(0xD2511F53u, c0, &hi0);
+        uint32_t lo1 = philox_mulhilo(0xCD9E8D57u, c2, &hi1);
+        c0 = hi1 ^ c1 ^ k0;
+        c1 = lo1;
+        c2 = hi0 ^ c3 ^ k1;
+        c3 = lo0;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    r.v[0] = c0;
+    r.v[1] = c1;
+    r.v[2] = c2;
+    r.v[3] = c3;
+    return r;
+}
+
+/* Uniform double in [0,1) with 53 random bits from two words */
+static inline double philox_u01(uint32_t hi, uint32_t lo)
+{
+    return (double) (((uint64_t) hi << 21) ^ (lo >> 11)) * 0x1p-53;
+}
+
+/* Uniform float in [0,1) with 24 random bits from one word */
+static inline float philox_f01(uint32_t w)
+{
+    return (float) (w >> 8) * 0x1p-24f;
+}
+
+/* Integer in [0,n) from one word, by multiply and shift */
+static inline uint32_t philox_below(uint32_t w, uint32_t n)
+{
+    return (uint32_t) (((uint64_t) w * n) >> 32);
+}
+
+/*
+ * Element i of a random permutation of 0..n-1, with no need to build
+ * the rest: a four-round Feistel network, with Philox as its round
+ * function, shuffles the smallest range of 4^k numbers that holds n,
+ * and we walk the cycle until we land back inside 0..n-1 (at most a
+ * few steps on average, since the range is under 4n).
+ */
+static inline uint64_t philox_permute(uint64_t seed, uint64_t n, uint64_t i)
+{
+    int half = 1;
+    while (half < 32 && (1ULL << 2*half) < n)
+        ++half;
+    uint64_t mask = (1ULL << half) - 1;
+
+    do {
+        uint64_t l = i >> half, r = i & mask;
+        for (int round = 0; round < 4; ++round) {
+            uint64_t f = philox4x32(seed, round, r).v[0] & mask;
+            uint64_t t = l ^ f;
+            l = r;
+            r = t;
+        }
+        i = (l << half) | r;
+    } while (i >= n);
+    return i;
+}
+
+/*
+ * A sequential stream, for loops that use a variable number of draws
+ * (rejection sampling); it hands out the words of elements 0, 1, 2, ...
+ * of one stream in turn.
+ */
+typedef struct philox_stream_t {
+    uint64_t     seed;
+    uint64_t     stream;
+    uint64_t     i;      /* Next element to generate */
+    philox4x32_t buf;    /* Words of element i-1      */
+    int          used;   /* Words of buf handed out   */
+} philox_stream_t;
+
+static inline void philox_stream_init(philox_stream_t* s, uint64_t seed,
+                                      uint64_t stream)
+{
+    s->seed   = seed;
+    s->stream = stream;
+    s->i      = 0;
+    s->used   = 4;
+}
+
+static inline uint32_t philox_next(philox_stream_t* s)
+{
+    if (s->used == 4) {
+        s->buf  = philox4x32(s->seed, s->stream, s->i++);
+        s->used = 0;
+    }
+    return s->buf.v[s->used++];
+}
+
+static inline double philox_next_u01(philox_stream_t* s)
+{
+    uint32_t hi = philox_next(s);
+    return philox_u01(hi, philox_next(s));
+}
+
+#endif /* PHILOX_H */